@@ -0,0 +1,492 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * KUnit tests for the Nintendo Switch 2 controller report decoders and
+ * rumble encoder
+ *
+ * Every report below is spelled out byte for byte in the controllers' wire
+ * format and every expected value was worked out by hand, so a mistake in
+ * the driver's layout tables shows up here instead of being copied into the
+ * test.
+ */
+
+#include "hid-switch2.h"
+#include <kunit/test.h>
+#include <linux/input.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+
+#define NS2_TEST_BENCH_LOOPS 100000
+
+struct switch2_test_ctx {
+	struct switch2_controller *ns2;
+	struct switch2_calibration *calib;
+	struct input_dev *input;
+};
+
+/* Stick calibration block as read from flash: neutral 2048, 1000 either way */
+static const uint8_t switch2_test_stick_calib[9] = {
+	0x00, 0x08, 0x80, 0xe8, 0x83, 0x3e, 0xe8, 0x83, 0x3e,
+};
+
+/* Pro Controller 0x09: A, up and HOME; left stick right, right stick down-left */
+static const uint8_t switch2_test_pro[15] = {
+	0x09, 0x00, 0x00, 0x02, 0x08, 0x01, 0xff, 0x0f, 0x80,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Pro Controller 0x09: nothing pressed, left stick half right and a quarter down */
+static const uint8_t switch2_test_pro_calibrated[15] = {
+	0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf4, 0x69, 0x70,
+	0x00, 0x08, 0x80, 0x00, 0x00, 0x00,
+};
+
+/* Left Joy-Con 0x07: L, d-pad left and capture; stick up-left */
+static const uint8_t switch2_test_jcl[15] = {
+	0x07, 0x00, 0x00, 0x14, 0x01, 0x00, 0x00, 0xf0, 0xff,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* Right Joy-Con 0x08: X, RS and GR; stick centred */
+static const uint8_t switch2_test_jcr[15] = {
+	0x08, 0x00, 0x00, 0x88, 0x04, 0x00, 0x00, 0x08, 0x80,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* GameCube controller 0x0a: B, minus and capture; LT half way, RT fully in */
+static const uint8_t switch2_test_gc[15] = {
+	0x0a, 0x00, 0x00, 0x01, 0x40, 0x02, 0x00, 0x08, 0x80,
+	0x00, 0x08, 0x80, 0x00, 0x84, 0xe8,
+};
+
+/* Pro Controller 0x05: A, HOME, d-pad right and GL; left stick right */
+static const uint8_t switch2_test_pro_unified[64] = {
+	0x05, 0x00, 0x00, 0x00, 0x00, 0x08, 0x10, 0x04, 0x02, 0x00, 0x00,
+	0xff, 0x0f, 0x80, 0x00, 0x08, 0x80,
+};
+
+static int switch2_test_init(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	ctx->ns2 = kunit_kzalloc(test, sizeof(*ctx->ns2), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->ns2);
+	ctx->calib = kunit_kzalloc(test, sizeof(*ctx->calib), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->calib);
+	ctx->ns2->stats = alloc_percpu(struct switch2_stats);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->ns2->stats);
+
+	ctx->ns2->phys = "kunit";
+	ctx->ns2->features = NS2_FEATURE_BUTTONS | NS2_FEATURE_ANALOG;
+	switch2_prepare_stick_calibration(&ctx->calib->stick[0]);
+	switch2_prepare_stick_calibration(&ctx->calib->stick[1]);
+	ctx->calib->generation = 1;
+#ifdef CONFIG_SWITCH2_FF
+	spin_lock_init(&ctx->ns2->rumble_lock);
+#endif
+	test->priv = ctx;
+	return 0;
+}
+
+static void switch2_test_exit(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+
+	if (ctx->input)
+		input_free_device(ctx->input);
+	free_percpu(ctx->ns2->stats);
+}
+
+/* An unregistered input device of @type, which the decoder reports into */
+static struct input_dev *switch2_test_input(struct kunit *test, enum switch2_ctlr_type type)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+
+	ctx->input = input_allocate_device();
+	KUNIT_ASSERT_NOT_NULL(test, ctx->input);
+	KUNIT_ASSERT_EQ(test, switch2_config_input(ctx->input, type), 0);
+	ctx->ns2->ctlr_type = type;
+	return ctx->input;
+}
+
+static void switch2_test_decode(struct kunit *test, const uint8_t *report, int size)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+
+	KUNIT_ASSERT_EQ(test, switch2_decode(ctx->ns2, ctx->input, NULL, NULL, NULL,
+		ctx->calib, report[0], report, size), 0);
+}
+
+static void switch2_test_pro_report(struct kunit *test)
+{
+	struct input_dev *input = switch2_test_input(test, NS2_CTLR_TYPE_PRO);
+
+	switch2_test_decode(test, switch2_test_pro, sizeof(switch2_test_pro));
+
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_SOUTH, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_MODE, input->key));
+	KUNIT_EXPECT_FALSE(test, test_bit(BTN_EAST, input->key));
+	KUNIT_EXPECT_FALSE(test, test_bit(BTN_TL, input->key));
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_HAT0X), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_HAT0Y), -1);
+	/* Uncalibrated, (raw - 2048) * 16 with y inverted */
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_X), 32752);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_Y), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RX), -32768);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RY), 32767);
+}
+
+static void switch2_test_pro_calibration(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+	struct input_dev *input = switch2_test_input(test, NS2_CTLR_TYPE_PRO);
+	struct switch2_stick_calibration *stick = &ctx->calib->stick[0];
+
+	KUNIT_ASSERT_TRUE(test, switch2_parse_stick_calibration(stick,
+		switch2_test_stick_calib));
+	KUNIT_EXPECT_EQ(test, stick->x.neutral, 2048);
+	KUNIT_EXPECT_EQ(test, stick->y.neutral, 2048);
+	KUNIT_EXPECT_EQ(test, stick->x.positive, 1000);
+	KUNIT_EXPECT_EQ(test, stick->y.positive, 1000);
+	KUNIT_EXPECT_EQ(test, stick->x.negative, 1000);
+	KUNIT_EXPECT_EQ(test, stick->y.negative, 1000);
+
+	/* Raw 2548 is 500 of 1000 right, raw 1798 is 250 of 1000 down */
+	switch2_test_decode(test, switch2_test_pro_calibrated,
+		sizeof(switch2_test_pro_calibrated));
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_X), 16384);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_Y), 8192);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RX), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RY), 0);
+}
+
+static void switch2_test_uncalibrated_block(struct kunit *test)
+{
+	static const uint8_t erased[9] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	};
+	struct switch2_stick_calibration stick = {};
+
+	KUNIT_EXPECT_FALSE(test, switch2_parse_stick_calibration(&stick, erased));
+	KUNIT_EXPECT_EQ(test, stick.x.neutral, 0);
+}
+
+static void switch2_test_jcl_report(struct kunit *test)
+{
+	struct input_dev *input = switch2_test_input(test, NS2_CTLR_TYPE_JCL);
+
+	switch2_test_decode(test, switch2_test_jcl, sizeof(switch2_test_jcl));
+
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_TL, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(KEY_RECORD, input->key));
+	KUNIT_EXPECT_FALSE(test, test_bit(BTN_TL2, input->key));
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_HAT0X), -1);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_HAT0Y), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_X), -32768);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_Y), -32752);
+}
+
+static void switch2_test_jcr_report(struct kunit *test)
+{
+	struct input_dev *input = switch2_test_input(test, NS2_CTLR_TYPE_JCR);
+
+	switch2_test_decode(test, switch2_test_jcr, sizeof(switch2_test_jcr));
+
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_NORTH, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_THUMBR, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_GRIPR, input->key));
+	KUNIT_EXPECT_FALSE(test, test_bit(BTN_SOUTH, input->key));
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RX), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RY), 0);
+}
+
+static void switch2_test_gc_report(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+	struct input_dev *input = switch2_test_input(test, NS2_CTLR_TYPE_GC);
+
+	/* Triggers rest at 32 and bottom out at 232 */
+	ctx->calib->lt_zero = 0x20;
+	ctx->calib->rt_zero = 0x20;
+	switch2_test_decode(test, switch2_test_gc, sizeof(switch2_test_gc));
+
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_EAST, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_SELECT, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(KEY_RECORD, input->key));
+	KUNIT_EXPECT_FALSE(test, test_bit(BTN_MODE, input->key));
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_X), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RY), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_Z), 2048);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RZ), 4095);
+}
+
+static void switch2_test_unified_report(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+	struct input_dev *input = switch2_test_input(test, NS2_CTLR_TYPE_PRO);
+
+	switch2_test_decode(test, switch2_test_pro_unified, sizeof(switch2_test_pro_unified));
+
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_SOUTH, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_MODE, input->key));
+	KUNIT_EXPECT_TRUE(test, test_bit(BTN_GRIPL, input->key));
+	KUNIT_EXPECT_FALSE(test, test_bit(BTN_GRIPR, input->key));
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_HAT0X), 1);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_HAT0Y), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_X), 32752);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_Y), 0);
+	KUNIT_EXPECT_EQ(test, input_abs_get_val(input, ABS_RX), 0);
+
+	/* Too short for its layout */
+	KUNIT_EXPECT_EQ(test, switch2_decode(ctx->ns2, input, NULL, NULL, NULL, ctx->calib,
+		switch2_test_pro_unified[0], switch2_test_pro_unified, 15), -EINVAL);
+}
+
+static u64 switch2_test_deduped(struct switch2_controller *ns2)
+{
+	u64 total = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		total += per_cpu_ptr(ns2->stats, cpu)->reports_deduped;
+	return total;
+}
+
+static void switch2_test_dedup(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+
+	switch2_test_input(test, NS2_CTLR_TYPE_PRO);
+	switch2_test_decode(test, switch2_test_pro, sizeof(switch2_test_pro));
+	KUNIT_EXPECT_EQ(test, switch2_test_deduped(ctx->ns2), 0);
+	switch2_test_decode(test, switch2_test_pro, sizeof(switch2_test_pro));
+	KUNIT_EXPECT_EQ(test, switch2_test_deduped(ctx->ns2), 1);
+
+	/* New calibration has to reach the sticks even if the report didn't change */
+	ctx->calib->generation++;
+	switch2_test_decode(test, switch2_test_pro, sizeof(switch2_test_pro));
+	KUNIT_EXPECT_EQ(test, switch2_test_deduped(ctx->ns2), 1);
+}
+
+/* The calibration blocks next to each other in flash are fetched together */
+static void switch2_test_plan_flash_read(struct kunit *test)
+{
+	struct switch2_controller *ns2 = ((struct switch2_test_ctx *)test->priv)->ns2;
+	struct switch2_cfg_intf cfg = { .max_reply = 320 };
+	unsigned long steps;
+	uint32_t address;
+	uint8_t size;
+
+	ns2->cfg = &cfg;
+	ns2->init_sent = BIT(NS2_INIT_READ_SERIAL) | BIT(NS2_INIT_GET_FIRMWARE_INFO);
+	ns2->init_done = ns2->init_sent;
+
+	/* Both factory stick blocks, 0x130a8 to 0x130f0 */
+	ns2->ctlr_type = NS2_CTLR_TYPE_PRO;
+	steps = switch2_init_plan_flash_read(ns2, NS2_INIT_READ_FACTORY_PRIMARY_CALIB,
+		&address, &size);
+	KUNIT_EXPECT_EQ(test, steps, BIT(NS2_INIT_READ_FACTORY_PRIMARY_CALIB) |
+		BIT(NS2_INIT_READ_FACTORY_SECONDARY_CALIB));
+	KUNIT_EXPECT_EQ(test, address, 0x130a8);
+	KUNIT_EXPECT_EQ(test, size, 0x49);
+
+	/* The GameCube controller's trigger block comes along, up to 0x13141 */
+	ns2->ctlr_type = NS2_CTLR_TYPE_GC;
+	steps = switch2_init_plan_flash_read(ns2, NS2_INIT_READ_FACTORY_PRIMARY_CALIB,
+		&address, &size);
+	KUNIT_EXPECT_EQ(test, steps, BIT(NS2_INIT_READ_FACTORY_PRIMARY_CALIB) |
+		BIT(NS2_INIT_READ_FACTORY_SECONDARY_CALIB) |
+		BIT(NS2_INIT_READ_FACTORY_TRIGGER_CALIB));
+	KUNIT_EXPECT_EQ(test, address, 0x130a8);
+	KUNIT_EXPECT_EQ(test, size, 0x9a);
+
+	/* Both user stick blocks once the factory ones are in, 0x1fc040 to 0x1fc08a */
+	ns2->ctlr_type = NS2_CTLR_TYPE_PRO;
+	ns2->init_sent |= GENMASK(NS2_INIT_READ_FACTORY_TRIGGER_CALIB,
+		NS2_INIT_READ_FACTORY_PRIMARY_CALIB);
+	ns2->init_done = ns2->init_sent;
+	steps = switch2_init_plan_flash_read(ns2, NS2_INIT_READ_USER_PRIMARY_CALIB,
+		&address, &size);
+	KUNIT_EXPECT_EQ(test, steps, BIT(NS2_INIT_READ_USER_PRIMARY_CALIB) |
+		BIT(NS2_INIT_READ_USER_SECONDARY_CALIB));
+	KUNIT_EXPECT_EQ(test, address, 0x1fc040);
+	KUNIT_EXPECT_EQ(test, size, 0x4b);
+
+	/* A single 64-byte packet only has room for one block */
+	cfg.max_reply = 64;
+	steps = switch2_init_plan_flash_read(ns2, NS2_INIT_READ_USER_PRIMARY_CALIB,
+		&address, &size);
+	KUNIT_EXPECT_EQ(test, steps, BIT(NS2_INIT_READ_USER_PRIMARY_CALIB));
+	KUNIT_EXPECT_EQ(test, size, 11);
+}
+
+/* The multiply and shift must match the division it replaces for every input */
+static void switch2_test_axis_range(struct kunit *test)
+{
+	uint32_t scale;
+	uint8_t shift;
+	uint16_t range;
+	uint32_t x;
+
+	for (range = 1; range < 4096; range++) {
+		switch2_prepare_axis_range(range, &scale, &shift);
+		for (x = 0; x < 4096; x++)
+			if (((uint64_t)x * scale) >> shift != ((uint64_t)x << 15) / range)
+				KUNIT_FAIL(test, "range %u, x %u: %llu != %llu", range, x,
+					((uint64_t)x * scale) >> shift,
+					((uint64_t)x << 15) / range);
+		cond_resched();
+	}
+}
+
+#ifdef CONFIG_SWITCH2_FF
+static void switch2_test_encode_rumble(struct kunit *test)
+{
+	/* The default FF_RUMBLE tone at full strength, 450 on both bands */
+	static const struct switch2_hd_rumble rumble = { 0x187, 0x1c2, 0x112, 0x1c2 };
+	static const uint8_t expected[5] = { 0x87, 0x09, 0x27, 0x91, 0x70 };
+	uint8_t buf[5];
+
+	switch2_encode_rumble(&rumble, buf);
+	KUNIT_EXPECT_MEMEQ(test, buf, expected, sizeof(expected));
+}
+
+static void switch2_test_fill_rumble_pro(struct kunit *test)
+{
+	struct switch2_controller *ns2 = ((struct switch2_test_ctx *)test->priv)->ns2;
+	static const uint8_t block[6] = { 0x50, 0x87, 0x09, 0x27, 0x91, 0x70 };
+	uint8_t frame[NS2_RUMBLE_SIZE];
+
+	ns2->ctlr_type = NS2_CTLR_TYPE_PRO;
+	ns2->rumble.hd = (struct switch2_hd_rumble){ 0x187, 0x1c2, 0x112, 0x1c2 };
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+		KUNIT_EXPECT_TRUE(test, switch2_fill_rumble(ns2, frame, 1));
+
+	/* Both LRAs get the same block */
+	KUNIT_EXPECT_EQ(test, frame[0], 0x02);
+	KUNIT_EXPECT_MEMEQ(test, &frame[0x01], block, sizeof(block));
+	KUNIT_EXPECT_MEMEQ(test, &frame[0x11], block, sizeof(block));
+	KUNIT_EXPECT_EQ(test, ns2->rumble_seq, 1);
+}
+
+static void switch2_test_fill_rumble_erm(struct kunit *test)
+{
+	struct switch2_controller *ns2 = ((struct switch2_test_ctx *)test->priv)->ns2;
+	/* A third of full strength is on one frame in three */
+	static const uint8_t expected[] = { 1, 0, 0, 1, 0, 0 };
+	uint8_t frame[NS2_RUMBLE_SIZE];
+	unsigned int i;
+
+	ns2->ctlr_type = NS2_CTLR_TYPE_GC;
+	ns2->rumble.sd.amplitude = U16_MAX / 3;
+	for (i = 0; i < ARRAY_SIZE(expected); i++) {
+		scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+			KUNIT_EXPECT_TRUE(test, switch2_fill_rumble(ns2, frame, 1));
+		KUNIT_EXPECT_EQ(test, frame[0], 3);
+		KUNIT_EXPECT_EQ(test, frame[1], 0x50 | i);
+		KUNIT_EXPECT_EQ_MSG(test, frame[2], expected[i], "frame %u", i);
+	}
+
+	ns2->rumble.sd.amplitude = 0;
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+		KUNIT_EXPECT_FALSE(test, switch2_fill_rumble(ns2, frame, 1));
+	KUNIT_EXPECT_EQ(test, frame[2], 2);
+}
+#endif
+
+/*
+ * Timings rather than checks: each prints the cost per report or frame, so a
+ * regression shows up when comparing runs on the same machine.
+ */
+static void switch2_test_bench_decode(struct kunit *test)
+{
+	struct switch2_test_ctx *ctx = test->priv;
+	const uint8_t *report;
+	u64 start, busy, repeat;
+	int i;
+
+	switch2_test_input(test, NS2_CTLR_TYPE_PRO);
+
+	/* Alternating between two reports defeats the deduplication */
+	start = ktime_get_ns();
+	for (i = 0; i < NS2_TEST_BENCH_LOOPS; i++) {
+		report = i & 1 ? switch2_test_pro_calibrated : switch2_test_pro;
+		switch2_decode(ctx->ns2, ctx->input, NULL, NULL, NULL, ctx->calib,
+			report[0], report, sizeof(switch2_test_pro));
+	}
+	busy = ktime_get_ns() - start;
+
+	/* Identical reports take the deduplication shortcut */
+	start = ktime_get_ns();
+	for (i = 0; i < NS2_TEST_BENCH_LOOPS; i++)
+		switch2_decode(ctx->ns2, ctx->input, NULL, NULL, NULL, ctx->calib,
+			NS2_REPORT_PRO, switch2_test_pro, sizeof(switch2_test_pro));
+	repeat = ktime_get_ns() - start;
+
+	kunit_info(test, "%llu ns/report, %llu ns/repeat\n",
+		div_u64(busy, NS2_TEST_BENCH_LOOPS), div_u64(repeat, NS2_TEST_BENCH_LOOPS));
+}
+
+#ifdef CONFIG_SWITCH2_FF
+static void switch2_test_bench_rumble(struct kunit *test)
+{
+	struct switch2_controller *ns2 = ((struct switch2_test_ctx *)test->priv)->ns2;
+	uint8_t frame[NS2_RUMBLE_SIZE];
+	u64 start, elapsed;
+	int i;
+
+	ns2->ctlr_type = NS2_CTLR_TYPE_PRO;
+	ns2->rumble.hd = (struct switch2_hd_rumble){ 0x187, 0xe1, 0x112, 0xe1 };
+
+	start = ktime_get_ns();
+	for (i = 0; i < NS2_TEST_BENCH_LOOPS; i++) {
+		guard(spinlock_irqsave)(&ns2->rumble_lock);
+		switch2_fill_rumble(ns2, frame, 1);
+	}
+	elapsed = ktime_get_ns() - start;
+
+	kunit_info(test, "%llu ns/frame\n", div_u64(elapsed, NS2_TEST_BENCH_LOOPS));
+}
+#endif
+
+static struct kunit_case switch2_test_cases[] = {
+	KUNIT_CASE(switch2_test_pro_report),
+	KUNIT_CASE(switch2_test_pro_calibration),
+	KUNIT_CASE(switch2_test_uncalibrated_block),
+	KUNIT_CASE(switch2_test_jcl_report),
+	KUNIT_CASE(switch2_test_jcr_report),
+	KUNIT_CASE(switch2_test_gc_report),
+	KUNIT_CASE(switch2_test_unified_report),
+	KUNIT_CASE(switch2_test_dedup),
+	KUNIT_CASE(switch2_test_plan_flash_read),
+	KUNIT_CASE_SLOW(switch2_test_axis_range),
+#ifdef CONFIG_SWITCH2_FF
+	KUNIT_CASE(switch2_test_encode_rumble),
+	KUNIT_CASE(switch2_test_fill_rumble_pro),
+	KUNIT_CASE(switch2_test_fill_rumble_erm),
+#endif
+	KUNIT_CASE_SLOW(switch2_test_bench_decode),
+#ifdef CONFIG_SWITCH2_FF
+	KUNIT_CASE_SLOW(switch2_test_bench_rumble),
+#endif
+	{}
+};
+
+static struct kunit_suite switch2_test_suite = {
+	.name = "hid-switch2",
+	.init = switch2_test_init,
+	.exit = switch2_test_exit,
+	.test_cases = switch2_test_cases,
+};
+kunit_test_suite(switch2_test_suite);
+
+MODULE_DESCRIPTION("KUnit tests for the Nintendo Switch 2 controller driver");
+MODULE_LICENSE("GPL");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("EXPORTED_FOR_KUNIT_TESTING");
+#else
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif
@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Tracepoints for the Nintendo Switch 2 controller drivers
+ *
+ * Every event carries the controller's USB path so a trace of several
+ * controllers can be split up again. Bulk-in completions carry a sequence
+ * number that is repeated when the worker picks the message up, and input
+ * reports and rumble frames carry their own, so latencies can be measured
+ * between matching events.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM switch2
+
+#if !defined(_HID_SWITCH2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HID_SWITCH2_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(switch2_bulk_in,
+	TP_PROTO(const char *phys, u32 seq, int status, u32 length),
+	TP_ARGS(phys, seq, status, length),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u32, seq)
+		__field(int, status)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->seq = seq;
+		__entry->status = status;
+		__entry->length = length;
+	),
+	TP_printk("%s seq=%u status=%d length=%u", __get_str(phys), __entry->seq,
+		__entry->status, __entry->length)
+);
+
+TRACE_EVENT(switch2_message_in,
+	TP_PROTO(const char *phys, u32 seq, u8 command, u8 subcommand),
+	TP_ARGS(phys, seq, command, subcommand),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u32, seq)
+		__field(u8, command)
+		__field(u8, subcommand)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->seq = seq;
+		__entry->command = command;
+		__entry->subcommand = subcommand;
+	),
+	TP_printk("%s seq=%u cmd=%02x:%02x", __get_str(phys), __entry->seq,
+		__entry->command, __entry->subcommand)
+);
+
+TRACE_EVENT(switch2_receive_command,
+	TP_PROTO(const char *phys, u8 command, u8 subcommand, u8 flags, u32 length,
+		bool matched),
+	TP_ARGS(phys, command, subcommand, flags, length, matched),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u8, command)
+		__field(u8, subcommand)
+		__field(u8, flags)
+		__field(bool, matched)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->command = command;
+		__entry->subcommand = subcommand;
+		__entry->flags = flags;
+		__entry->matched = matched;
+		__entry->length = length;
+	),
+	TP_printk("%s cmd=%02x:%02x flags=%02x length=%u matched=%d", __get_str(phys),
+		__entry->command, __entry->subcommand, __entry->flags, __entry->length,
+		__entry->matched)
+);
+
+TRACE_EVENT(switch2_send_command,
+	TP_PROTO(const char *phys, u8 command, u8 subcommand, u32 length, bool queued),
+	TP_ARGS(phys, command, subcommand, length, queued),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u8, command)
+		__field(u8, subcommand)
+		__field(bool, queued)
+		__field(u32, length)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->command = command;
+		__entry->subcommand = subcommand;
+		__entry->queued = queued;
+		__entry->length = length;
+	),
+	TP_printk("%s cmd=%02x:%02x length=%u queued=%d", __get_str(phys),
+		__entry->command, __entry->subcommand, __entry->length, __entry->queued)
+);
+
+TRACE_EVENT(switch2_bulk_out,
+	TP_PROTO(const char *phys, unsigned int slot, int status),
+	TP_ARGS(phys, slot, status),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(unsigned int, slot)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->slot = slot;
+		__entry->status = status;
+	),
+	TP_printk("%s slot=%u status=%d", __get_str(phys), __entry->slot, __entry->status)
+);
+
+DECLARE_EVENT_CLASS(switch2_report,
+	TP_PROTO(const char *phys, u8 report_id, u32 seq, int size),
+	TP_ARGS(phys, report_id, seq, size),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u8, report_id)
+		__field(u32, seq)
+		__field(int, size)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->report_id = report_id;
+		__entry->seq = seq;
+		__entry->size = size;
+	),
+	TP_printk("%s id=%02x seq=%u size=%d", __get_str(phys), __entry->report_id,
+		__entry->seq, __entry->size)
+);
+
+/* An input report arrived from HID core */
+DEFINE_EVENT(switch2_report, switch2_event,
+	TP_PROTO(const char *phys, u8 report_id, u32 seq, int size),
+	TP_ARGS(phys, report_id, seq, size)
+);
+
+/* The same report has been decoded and input_sync() called */
+DEFINE_EVENT(switch2_report, switch2_event_done,
+	TP_PROTO(const char *phys, u8 report_id, u32 seq, int size),
+	TP_ARGS(phys, report_id, seq, size)
+);
+
+TRACE_EVENT(switch2_play_effect,
+	TP_PROTO(const char *phys, u16 strong, u16 weak),
+	TP_ARGS(phys, strong, weak),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u16, strong)
+		__field(u16, weak)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->strong = strong;
+		__entry->weak = weak;
+	),
+	TP_printk("%s strong=%u weak=%u", __get_str(phys), __entry->strong, __entry->weak)
+);
+
+TRACE_EVENT(switch2_rumble_frame,
+	TP_PROTO(const char *phys, u8 seq, unsigned int ticks, bool sent),
+	TP_ARGS(phys, seq, ticks, sent),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u8, seq)
+		__field(bool, sent)
+		__field(unsigned int, ticks)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->seq = seq;
+		__entry->sent = sent;
+		__entry->ticks = ticks;
+	),
+	TP_printk("%s seq=%u ticks=%u sent=%d", __get_str(phys), __entry->seq,
+		__entry->ticks, __entry->sent)
+);
+
+/* A rumble frame's URB has completed */
+TRACE_EVENT(switch2_rumble_done,
+	TP_PROTO(const char *phys, u8 seq, int status),
+	TP_ARGS(phys, seq, status),
+	TP_STRUCT__entry(
+		__string(phys, phys)
+		__field(u8, seq)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__assign_str(phys);
+		__entry->seq = seq;
+		__entry->status = status;
+	),
+	TP_printk("%s seq=%u status=%d", __get_str(phys), __entry->seq, __entry->status)
+);
+
+#endif /* _HID_SWITCH2_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-switch2-trace
+#include <trace/define_trace.h>
@@ -11,13 +11,34 @@
  */
 
 #include "hid-switch2.h"
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/firmware.h>
 #include <linux/hid.h>
 #include <linux/idr.h>
+#include <linux/jhash.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <kunit/visibility.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/usb.h>
+#include <linux/unaligned.h>
+#include <linux/vmalloc.h>
+
+#define CREATE_TRACE_POINTS
+#include "hid-switch2-trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(switch2_bulk_in);
+EXPORT_TRACEPOINT_SYMBOL_GPL(switch2_message_in);
+EXPORT_TRACEPOINT_SYMBOL_GPL(switch2_send_command);
+EXPORT_TRACEPOINT_SYMBOL_GPL(switch2_bulk_out);
 
 /*
  * hid_to_usb_dev() is defined in drivers/hid/usbhid/usbhid.h which is
@@ -29,6 +50,25 @@ static inline struct usb_device *hid_to_usb_dev(struct hid_device *hdev)
 	return interface_to_usbdev(to_usb_interface(hdev->dev.parent));
 }
 
+/*
+ * The bulk interface can probe first, and replay controllers never get an
+ * HID device at all, so messages from the command and calibration paths fall
+ * back to the controller's phys when there is no hdev to attach them to.
+ */
+#define switch2_printk(hid_fn, pr_fn, ns2, fmt, ...)			\
+do {									\
+	struct hid_device *__hdev = READ_ONCE((ns2)->hdev);		\
+									\
+	if (__hdev)							\
+		hid_fn(__hdev, fmt, ##__VA_ARGS__);			\
+	else								\
+		pr_fn("%s: " fmt, (ns2)->phys, ##__VA_ARGS__);		\
+} while (0)
+#define switch2_dbg(ns2, fmt, ...) \
+	switch2_printk(hid_dbg, pr_debug, ns2, fmt, ##__VA_ARGS__)
+#define switch2_warn(ns2, fmt, ...) \
+	switch2_printk(hid_warn, pr_warn, ns2, fmt, ##__VA_ARGS__)
+
 #define NS2_BTNR_B	BIT(0)
 #define NS2_BTNR_A	BIT(1)
 #define NS2_BTNR_Y	BIT(2)
@@ -72,11 +112,40 @@ static inline struct usb_device *hid_to_usb_dev(struct hid_device *hdev)
 #define NS2_BTN_GC_CAPTURE	BIT(1)
 #define NS2_BTN_GC_C		NS2_BTN3_C
 
+/* Button bits of the unified report, which share one layout across controllers */
+#define NS2_UBTN0_Y		BIT(0)
+#define NS2_UBTN0_X		BIT(1)
+#define NS2_UBTN0_B		BIT(2)
+#define NS2_UBTN0_A		BIT(3)
+#define NS2_UBTN0_R		BIT(6)
+#define NS2_UBTN0_ZR		BIT(7)
+
+#define NS2_UBTN1_MINUS		BIT(0)
+#define NS2_UBTN1_PLUS		BIT(1)
+#define NS2_UBTN1_RS		BIT(2)
+#define NS2_UBTN1_LS		BIT(3)
+#define NS2_UBTN1_HOME		BIT(4)
+#define NS2_UBTN1_CAPTURE	BIT(5)
+#define NS2_UBTN1_C		BIT(6)
+
+#define NS2_UBTN2_DOWN		BIT(0)
+#define NS2_UBTN2_UP		BIT(1)
+#define NS2_UBTN2_RIGHT		BIT(2)
+#define NS2_UBTN2_LEFT		BIT(3)
+#define NS2_UBTN2_L		BIT(6)
+#define NS2_UBTN2_ZL		BIT(7)
+
+#define NS2_UBTN3_GR		BIT(0)
+#define NS2_UBTN3_GL		BIT(1)
+
 #define NS2_TRIGGER_RANGE	4095
 #define NS2_AXIS_MIN		-32768
 #define NS2_AXIS_MAX		32767
 
-#define NS2_MAX_PLAYER_ID	8
+/* The IMU runs at +-8 G and +-2000 degrees per second full scale */
+#define NS2_IMU_ACCEL_RES_PER_G	4096
+#define NS2_IMU_GYRO_RES_PER_DPS	16
+#define NS2_IMU_SAMPLE_SIZE	12
 
 enum gc_rumble {
 	GC_RUMBLE_OFF = 0,
@@ -103,78 +172,351 @@ enum gc_rumble {
 #define RUMBLE_HI_FREQ 0x187
 #define RUMBLE_LO_FREQ 0x112
 
-static DEFINE_MUTEX(switch2_controllers_lock);
-static LIST_HEAD(switch2_controllers);
+/*
+ * Controllers by USB path. Lookups only take the RCU read lock, and each
+ * bucket has its own bit lock for insertion and removal, so probes for
+ * different controllers don't serialise.
+ */
+#define NS2_CONTROLLER_HASH_BITS 6
+static struct hlist_bl_head switch2_controllers[1 << NS2_CONTROLLER_HASH_BITS];
+
+/* Cache-line aligned, so the hot part of each controller starts on a line */
+static struct kmem_cache *switch2_controller_cache;
+/* What the input path touches per report fits in two 64-byte lines */
+static_assert(offsetof(struct switch2_controller, hdev) <= 128);
 
+/*
+ * The button bytes of every report are packed into one little-endian word, so
+ * a whole report can be compared against the previous one with a single XOR.
+ */
 struct switch2_ctlr_button_mapping {
 	uint32_t code;
-	int byte;
-	uint32_t bit;
+	uint32_t mask;
 };
 
+#define NS2_BUTTON(_code, _byte, _bit) { (_code), (uint32_t)(_bit) << (8 * (_byte)) }
+
 static const struct switch2_ctlr_button_mapping left_joycon_button_mappings[] = {
-	{ BTN_TL,	0, NS2_BTNL_L,		},
-	{ BTN_TL2,	0, NS2_BTNL_ZL,		},
-	{ BTN_SELECT,	0, NS2_BTNL_MINUS,	},
-	{ BTN_THUMBL,	0, NS2_BTNL_LS,		},
-	{ BTN_GRIPL,	1, NS2_BTN_JCL_GL,	},
-	{ KEY_RECORD,	1, NS2_BTN_JCL_CAPTURE,	},
-	{ /* sentinel */ },
+	NS2_BUTTON(BTN_TL,	0, NS2_BTNL_L),
+	NS2_BUTTON(BTN_TL2,	0, NS2_BTNL_ZL),
+	NS2_BUTTON(BTN_SELECT,	0, NS2_BTNL_MINUS),
+	NS2_BUTTON(BTN_THUMBL,	0, NS2_BTNL_LS),
+	NS2_BUTTON(BTN_GRIPL,	1, NS2_BTN_JCL_GL),
+	NS2_BUTTON(KEY_RECORD,	1, NS2_BTN_JCL_CAPTURE),
 };
 
 static const struct switch2_ctlr_button_mapping right_joycon_button_mappings[] = {
-	{ BTN_SOUTH,	0, NS2_BTNR_A,		},
-	{ BTN_EAST,	0, NS2_BTNR_B,		},
-	{ BTN_NORTH,	0, NS2_BTNR_X,		},
-	{ BTN_WEST,	0, NS2_BTNR_Y,		},
-	{ BTN_TR,	0, NS2_BTNR_R,		},
-	{ BTN_TR2,	0, NS2_BTNR_ZR,		},
-	{ BTN_START,	0, NS2_BTNR_PLUS,	},
-	{ BTN_THUMBR,	0, NS2_BTNR_RS,		},
-	{ BTN_C,	1, NS2_BTN_JCR_C,	},
-	{ BTN_GRIPR,	1, NS2_BTN_JCR_GR,	},
-	{ BTN_MODE,	1, NS2_BTN_JCR_HOME,	},
-	{ /* sentinel */ },
+	NS2_BUTTON(BTN_SOUTH,	0, NS2_BTNR_A),
+	NS2_BUTTON(BTN_EAST,	0, NS2_BTNR_B),
+	NS2_BUTTON(BTN_NORTH,	0, NS2_BTNR_X),
+	NS2_BUTTON(BTN_WEST,	0, NS2_BTNR_Y),
+	NS2_BUTTON(BTN_TR,	0, NS2_BTNR_R),
+	NS2_BUTTON(BTN_TR2,	0, NS2_BTNR_ZR),
+	NS2_BUTTON(BTN_START,	0, NS2_BTNR_PLUS),
+	NS2_BUTTON(BTN_THUMBR,	0, NS2_BTNR_RS),
+	NS2_BUTTON(BTN_C,	1, NS2_BTN_JCR_C),
+	NS2_BUTTON(BTN_GRIPR,	1, NS2_BTN_JCR_GR),
+	NS2_BUTTON(BTN_MODE,	1, NS2_BTN_JCR_HOME),
 };
 
 static const struct switch2_ctlr_button_mapping procon_mappings[] = {
-	{ BTN_SOUTH,	0, NS2_BTNR_A,		},
-	{ BTN_EAST,	0, NS2_BTNR_B,		},
-	{ BTN_NORTH,	0, NS2_BTNR_X,		},
-	{ BTN_WEST,	0, NS2_BTNR_Y,		},
-	{ BTN_TL,	1, NS2_BTNL_L,		},
-	{ BTN_TR,	0, NS2_BTNR_R,		},
-	{ BTN_TL2,	1, NS2_BTNL_ZL,		},
-	{ BTN_TR2,	0, NS2_BTNR_ZR,		},
-	{ BTN_SELECT,	1, NS2_BTNL_MINUS,	},
-	{ BTN_START,	0, NS2_BTNR_PLUS,	},
-	{ BTN_THUMBL,	1, NS2_BTNL_LS,		},
-	{ BTN_THUMBR,	0, NS2_BTNR_RS,		},
-	{ BTN_MODE,	2, NS2_BTN_PRO_HOME	},
-	{ KEY_RECORD,	2, NS2_BTN_PRO_CAPTURE	},
-	{ BTN_GRIPR,	2, NS2_BTN_PRO_GR	},
-	{ BTN_GRIPL,	2, NS2_BTN_PRO_GL	},
-	{ BTN_C,	2, NS2_BTN_PRO_C	},
-	{ /* sentinel */ },
+	NS2_BUTTON(BTN_SOUTH,	0, NS2_BTNR_A),
+	NS2_BUTTON(BTN_EAST,	0, NS2_BTNR_B),
+	NS2_BUTTON(BTN_NORTH,	0, NS2_BTNR_X),
+	NS2_BUTTON(BTN_WEST,	0, NS2_BTNR_Y),
+	NS2_BUTTON(BTN_TL,	1, NS2_BTNL_L),
+	NS2_BUTTON(BTN_TR,	0, NS2_BTNR_R),
+	NS2_BUTTON(BTN_TL2,	1, NS2_BTNL_ZL),
+	NS2_BUTTON(BTN_TR2,	0, NS2_BTNR_ZR),
+	NS2_BUTTON(BTN_SELECT,	1, NS2_BTNL_MINUS),
+	NS2_BUTTON(BTN_START,	0, NS2_BTNR_PLUS),
+	NS2_BUTTON(BTN_THUMBL,	1, NS2_BTNL_LS),
+	NS2_BUTTON(BTN_THUMBR,	0, NS2_BTNR_RS),
+	NS2_BUTTON(BTN_MODE,	2, NS2_BTN_PRO_HOME),
+	NS2_BUTTON(KEY_RECORD,	2, NS2_BTN_PRO_CAPTURE),
+	NS2_BUTTON(BTN_GRIPR,	2, NS2_BTN_PRO_GR),
+	NS2_BUTTON(BTN_GRIPL,	2, NS2_BTN_PRO_GL),
+	NS2_BUTTON(BTN_C,	2, NS2_BTN_PRO_C),
 };
 
 static const struct switch2_ctlr_button_mapping gccon_mappings[] = {
-	{ BTN_SOUTH,	0, NS2_BTNR_A,		},
-	{ BTN_EAST,	0, NS2_BTNR_B,		},
-	{ BTN_NORTH,	0, NS2_BTNR_X,		},
-	{ BTN_WEST,	0, NS2_BTNR_Y,		},
-	{ BTN_TL,	1, NS2_BTNL_L,		},
-	{ BTN_TR,	0, NS2_BTNR_R,		},
-	{ BTN_TL2,	1, NS2_BTNL_ZL,		},
-	{ BTN_TR2,	0, NS2_BTNR_ZR,		},
-	{ BTN_SELECT,	1, NS2_BTNL_MINUS,	},
-	{ BTN_START,	0, NS2_BTNR_PLUS,	},
-	{ BTN_MODE,	2, NS2_BTN_GC_HOME	},
-	{ KEY_RECORD,	2, NS2_BTN_GC_CAPTURE	},
-	{ BTN_C,	2, NS2_BTN_GC_C		},
-	{ /* sentinel */ },
+	NS2_BUTTON(BTN_SOUTH,	0, NS2_BTNR_A),
+	NS2_BUTTON(BTN_EAST,	0, NS2_BTNR_B),
+	NS2_BUTTON(BTN_NORTH,	0, NS2_BTNR_X),
+	NS2_BUTTON(BTN_WEST,	0, NS2_BTNR_Y),
+	NS2_BUTTON(BTN_TL,	1, NS2_BTNL_L),
+	NS2_BUTTON(BTN_TR,	0, NS2_BTNR_R),
+	NS2_BUTTON(BTN_TL2,	1, NS2_BTNL_ZL),
+	NS2_BUTTON(BTN_TR2,	0, NS2_BTNR_ZR),
+	NS2_BUTTON(BTN_SELECT,	1, NS2_BTNL_MINUS),
+	NS2_BUTTON(BTN_START,	0, NS2_BTNR_PLUS),
+	NS2_BUTTON(BTN_MODE,	2, NS2_BTN_GC_HOME),
+	NS2_BUTTON(KEY_RECORD,	2, NS2_BTN_GC_CAPTURE),
+	NS2_BUTTON(BTN_C,	2, NS2_BTN_GC_C),
+};
+
+static const struct switch2_ctlr_button_mapping left_joycon_unified_mappings[] = {
+	NS2_BUTTON(BTN_TL,	2, NS2_UBTN2_L),
+	NS2_BUTTON(BTN_TL2,	2, NS2_UBTN2_ZL),
+	NS2_BUTTON(BTN_SELECT,	1, NS2_UBTN1_MINUS),
+	NS2_BUTTON(BTN_THUMBL,	1, NS2_UBTN1_LS),
+	NS2_BUTTON(BTN_GRIPL,	3, NS2_UBTN3_GL),
+	NS2_BUTTON(KEY_RECORD,	1, NS2_UBTN1_CAPTURE),
+};
+
+static const struct switch2_ctlr_button_mapping right_joycon_unified_mappings[] = {
+	NS2_BUTTON(BTN_SOUTH,	0, NS2_UBTN0_A),
+	NS2_BUTTON(BTN_EAST,	0, NS2_UBTN0_B),
+	NS2_BUTTON(BTN_NORTH,	0, NS2_UBTN0_X),
+	NS2_BUTTON(BTN_WEST,	0, NS2_UBTN0_Y),
+	NS2_BUTTON(BTN_TR,	0, NS2_UBTN0_R),
+	NS2_BUTTON(BTN_TR2,	0, NS2_UBTN0_ZR),
+	NS2_BUTTON(BTN_START,	1, NS2_UBTN1_PLUS),
+	NS2_BUTTON(BTN_THUMBR,	1, NS2_UBTN1_RS),
+	NS2_BUTTON(BTN_C,	1, NS2_UBTN1_C),
+	NS2_BUTTON(BTN_GRIPR,	3, NS2_UBTN3_GR),
+	NS2_BUTTON(BTN_MODE,	1, NS2_UBTN1_HOME),
+};
+
+static const struct switch2_ctlr_button_mapping procon_unified_mappings[] = {
+	NS2_BUTTON(BTN_SOUTH,	0, NS2_UBTN0_A),
+	NS2_BUTTON(BTN_EAST,	0, NS2_UBTN0_B),
+	NS2_BUTTON(BTN_NORTH,	0, NS2_UBTN0_X),
+	NS2_BUTTON(BTN_WEST,	0, NS2_UBTN0_Y),
+	NS2_BUTTON(BTN_TL,	2, NS2_UBTN2_L),
+	NS2_BUTTON(BTN_TR,	0, NS2_UBTN0_R),
+	NS2_BUTTON(BTN_TL2,	2, NS2_UBTN2_ZL),
+	NS2_BUTTON(BTN_TR2,	0, NS2_UBTN0_ZR),
+	NS2_BUTTON(BTN_SELECT,	1, NS2_UBTN1_MINUS),
+	NS2_BUTTON(BTN_START,	1, NS2_UBTN1_PLUS),
+	NS2_BUTTON(BTN_THUMBL,	1, NS2_UBTN1_LS),
+	NS2_BUTTON(BTN_THUMBR,	1, NS2_UBTN1_RS),
+	NS2_BUTTON(BTN_MODE,	1, NS2_UBTN1_HOME),
+	NS2_BUTTON(KEY_RECORD,	1, NS2_UBTN1_CAPTURE),
+	NS2_BUTTON(BTN_GRIPR,	3, NS2_UBTN3_GR),
+	NS2_BUTTON(BTN_GRIPL,	3, NS2_UBTN3_GL),
+	NS2_BUTTON(BTN_C,	1, NS2_UBTN1_C),
+};
+
+static const struct switch2_ctlr_button_mapping gccon_unified_mappings[] = {
+	NS2_BUTTON(BTN_SOUTH,	0, NS2_UBTN0_A),
+	NS2_BUTTON(BTN_EAST,	0, NS2_UBTN0_B),
+	NS2_BUTTON(BTN_NORTH,	0, NS2_UBTN0_X),
+	NS2_BUTTON(BTN_WEST,	0, NS2_UBTN0_Y),
+	NS2_BUTTON(BTN_TL,	2, NS2_UBTN2_L),
+	NS2_BUTTON(BTN_TR,	0, NS2_UBTN0_R),
+	NS2_BUTTON(BTN_TL2,	2, NS2_UBTN2_ZL),
+	NS2_BUTTON(BTN_TR2,	0, NS2_UBTN0_ZR),
+	NS2_BUTTON(BTN_SELECT,	1, NS2_UBTN1_MINUS),
+	NS2_BUTTON(BTN_START,	1, NS2_UBTN1_PLUS),
+	NS2_BUTTON(BTN_MODE,	1, NS2_UBTN1_HOME),
+	NS2_BUTTON(KEY_RECORD,	1, NS2_UBTN1_CAPTURE),
+	NS2_BUTTON(BTN_C,	1, NS2_UBTN1_C),
+};
+
+/* In mouse mode the shoulder buttons click and pressing the stick is the middle button */
+static const struct switch2_ctlr_button_mapping left_joycon_mouse_mappings[] = {
+	NS2_BUTTON(BTN_LEFT,	2, NS2_UBTN2_L),
+	NS2_BUTTON(BTN_RIGHT,	2, NS2_UBTN2_ZL),
+	NS2_BUTTON(BTN_MIDDLE,	1, NS2_UBTN1_LS),
+};
+
+static const struct switch2_ctlr_button_mapping right_joycon_mouse_mappings[] = {
+	NS2_BUTTON(BTN_LEFT,	0, NS2_UBTN0_R),
+	NS2_BUTTON(BTN_RIGHT,	0, NS2_UBTN0_ZR),
+	NS2_BUTTON(BTN_MIDDLE,	1, NS2_UBTN1_RS),
+};
+
+/*
+ * Where each piece of state lives in an input report. Every report layout is
+ * decoded by the same code, see switch2_decode_report().
+ */
+struct switch2_stick_layout {
+	uint8_t offset;
+	uint8_t calib;
+	uint16_t x;
+	uint16_t y;
+};
+
+struct switch2_report_layout {
+	uint8_t size;
+	uint8_t buttons;
+	uint32_t button_bits;
+	uint32_t dpad_up;
+	uint32_t dpad_down;
+	uint32_t dpad_left;
+	uint32_t dpad_right;
+	const struct switch2_ctlr_button_mapping *mappings;
+	size_t mapping_count;
+	unsigned int stick_count;
+	struct switch2_stick_layout sticks[2];
+	/* Offset of the left trigger, followed by the right; 0 if none */
+	uint8_t triggers;
+	/*
+	 * Offset of the le32 IMU timestamp in microseconds and of the first
+	 * sample. Each sample is three le16 accelerometer axes followed by three
+	 * le16 gyroscope axes, the last one taken at the timestamp and the
+	 * earlier ones imu_period microseconds apart.
+	 */
+	uint8_t imu_timestamp;
+	uint8_t imu;
+	uint8_t imu_samples;
+	uint16_t imu_period;
+	/*
+	 * Offset of the optical sensor's le16 X and Y counters, which run freely
+	 * and wrap, and the buttons that click in mouse mode; 0 if none.
+	 */
+	uint8_t mouse;
+	const struct switch2_ctlr_button_mapping *mouse_mappings;
+	size_t mouse_mapping_count;
+};
+
+#define NS2_LAYOUT_BUTTONS(_mappings) \
+	.mappings = (_mappings), .mapping_count = ARRAY_SIZE(_mappings)
+#define NS2_LAYOUT_DPAD(_byte, _up, _down, _left, _right) \
+	.dpad_up = (uint32_t)(_up) << (8 * (_byte)), \
+	.dpad_down = (uint32_t)(_down) << (8 * (_byte)), \
+	.dpad_left = (uint32_t)(_left) << (8 * (_byte)), \
+	.dpad_right = (uint32_t)(_right) << (8 * (_byte))
+#define NS2_LAYOUT_MOUSE(_offset, _mappings) \
+	.mouse = (_offset), .mouse_mappings = (_mappings), \
+	.mouse_mapping_count = ARRAY_SIZE(_mappings)
+
+/* Reports 0x07 to 0x0a: three button bytes at offset 3, sticks from offset 6 */
+static const struct switch2_report_layout switch2_jcl_layout = {
+	.size = 15, .buttons = 3, .button_bits = 0xffffff,
+	NS2_LAYOUT_DPAD(0, NS2_BTNL_UP, NS2_BTNL_DOWN, NS2_BTNL_LEFT, NS2_BTNL_RIGHT),
+	NS2_LAYOUT_BUTTONS(left_joycon_button_mappings),
+	.stick_count = 1,
+	.sticks = { { 6, 0, ABS_X, ABS_Y } },
+};
+
+static const struct switch2_report_layout switch2_jcr_layout = {
+	.size = 15, .buttons = 3, .button_bits = 0xffffff,
+	NS2_LAYOUT_BUTTONS(right_joycon_button_mappings),
+	.stick_count = 1,
+	.sticks = { { 6, 0, ABS_RX, ABS_RY } },
+};
+
+static const struct switch2_report_layout switch2_procon_layout = {
+	.size = 15, .buttons = 3, .button_bits = 0xffffff,
+	NS2_LAYOUT_DPAD(1, NS2_BTNL_UP, NS2_BTNL_DOWN, NS2_BTNL_LEFT, NS2_BTNL_RIGHT),
+	NS2_LAYOUT_BUTTONS(procon_mappings),
+	.stick_count = 2,
+	.sticks = { { 6, 0, ABS_X, ABS_Y }, { 9, 1, ABS_RX, ABS_RY } },
+};
+
+static const struct switch2_report_layout switch2_gccon_layout = {
+	.size = 15, .buttons = 3, .button_bits = 0xffffff,
+	NS2_LAYOUT_DPAD(1, NS2_BTNL_UP, NS2_BTNL_DOWN, NS2_BTNL_LEFT, NS2_BTNL_RIGHT),
+	NS2_LAYOUT_BUTTONS(gccon_mappings),
+	.stick_count = 2,
+	.sticks = { { 6, 0, ABS_X, ABS_Y }, { 9, 1, ABS_RX, ABS_RY } },
+	.triggers = 13,
+};
+
+/*
+ * Report 0x05 uses the same layout for every controller: four button bytes
+ * at offset 5, the left stick at 0x0b, the right stick at 0x0e, one IMU
+ * sample timestamped at 0x2b and the analog triggers at 0x3d. A single
+ * Joy-Con reports its stick in the slot for its side, and its optical sensor
+ * right after the sticks at 0x11.
+ */
+#define NS2_UNIFIED_REPORT_SIZE 64
+#define NS2_LAYOUT_UNIFIED_IMU \
+	.imu_timestamp = 0x2b, .imu = 0x31, .imu_samples = 1
+#define NS2_UNIFIED_MOUSE 0x11
+/* Features whose data only comes in the unified report */
+#define NS2_FEATURES_UNIFIED (NS2_FEATURE_IMU | NS2_FEATURE_MOUSE)
+
+static const struct switch2_report_layout switch2_unified_layouts[] = {
+	[NS2_CTLR_TYPE_JCL] = {
+		.size = NS2_UNIFIED_REPORT_SIZE, .buttons = 5, .button_bits = 0xffffffff,
+		NS2_LAYOUT_DPAD(2, NS2_UBTN2_UP, NS2_UBTN2_DOWN, NS2_UBTN2_LEFT, NS2_UBTN2_RIGHT),
+		NS2_LAYOUT_BUTTONS(left_joycon_unified_mappings),
+		.stick_count = 1,
+		.sticks = { { 0x0b, 0, ABS_X, ABS_Y } },
+		NS2_LAYOUT_UNIFIED_IMU,
+		NS2_LAYOUT_MOUSE(NS2_UNIFIED_MOUSE, left_joycon_mouse_mappings),
+	},
+	[NS2_CTLR_TYPE_JCR] = {
+		.size = NS2_UNIFIED_REPORT_SIZE, .buttons = 5, .button_bits = 0xffffffff,
+		NS2_LAYOUT_BUTTONS(right_joycon_unified_mappings),
+		.stick_count = 1,
+		.sticks = { { 0x0e, 0, ABS_RX, ABS_RY } },
+		NS2_LAYOUT_UNIFIED_IMU,
+		NS2_LAYOUT_MOUSE(NS2_UNIFIED_MOUSE, right_joycon_mouse_mappings),
+	},
+	[NS2_CTLR_TYPE_PRO] = {
+		.size = NS2_UNIFIED_REPORT_SIZE, .buttons = 5, .button_bits = 0xffffffff,
+		NS2_LAYOUT_DPAD(2, NS2_UBTN2_UP, NS2_UBTN2_DOWN, NS2_UBTN2_LEFT, NS2_UBTN2_RIGHT),
+		NS2_LAYOUT_BUTTONS(procon_unified_mappings),
+		.stick_count = 2,
+		.sticks = { { 0x0b, 0, ABS_X, ABS_Y }, { 0x0e, 1, ABS_RX, ABS_RY } },
+		NS2_LAYOUT_UNIFIED_IMU,
+	},
+	[NS2_CTLR_TYPE_GC] = {
+		.size = NS2_UNIFIED_REPORT_SIZE, .buttons = 5, .button_bits = 0xffffffff,
+		NS2_LAYOUT_DPAD(2, NS2_UBTN2_UP, NS2_UBTN2_DOWN, NS2_UBTN2_LEFT, NS2_UBTN2_RIGHT),
+		NS2_LAYOUT_BUTTONS(gccon_unified_mappings),
+		.stick_count = 2,
+		.sticks = { { 0x0b, 0, ABS_X, ABS_Y }, { 0x0e, 1, ABS_RX, ABS_RY } },
+		NS2_LAYOUT_UNIFIED_IMU,
+		.triggers = 0x3d,
+	},
 };
 
+static bool unified_report;
+module_param(unified_report, bool, 0444);
+MODULE_PARM_DESC(unified_report,
+	"Switch controllers to the unified input report 0x05 during init");
+
+static bool imu;
+module_param(imu, bool, 0444);
+MODULE_PARM_DESC(imu,
+	"Enable the motion sensors as a separate input device (implies unified_report)");
+
+static unsigned int mouse_scale = 100;
+module_param(mouse_scale, uint, 0644);
+MODULE_PARM_DESC(mouse_scale,
+	"Pointer speed in mouse mode, in percent of the sensor's counts (1-1000, default 100)");
+
+static unsigned int mouse_wheel = 16;
+module_param(mouse_wheel, uint, 0644);
+MODULE_PARM_DESC(mouse_wheel,
+	"Stick scroll speed in mouse mode, in 1/120 notches per report at full tilt (0-960, default 16)");
+
+static unsigned int features = NS2_FEATURE_BUTTONS | NS2_FEATURE_ANALOG | NS2_FEATURE_RUMBLE;
+module_param(features, uint, 0644);
+MODULE_PARM_DESC(features,
+	"Default NS2_FEATURE_* mask for new controllers (default 0x23; imu adds 0x04)");
+
+static uint32_t switch2_default_features(void)
+{
+	return (READ_ONCE(features) & NS2_FEATURES_ALL) | (imu ? NS2_FEATURE_IMU : 0);
+}
+
+/*
+ * Response handling and rumble fallback work go through our own high
+ * priority workqueue so they don't queue up behind unrelated work on the
+ * system workqueue.
+ */
+static struct workqueue_struct *switch2_wq;
+static int wq_cpu = -1;
+module_param(wq_cpu, int, 0644);
+MODULE_PARM_DESC(wq_cpu,
+	"CPU to run controller work on, or -1 for the CPU that queued it (default)");
+
+bool switch2_queue_work(struct work_struct *work)
+{
+	int cpu = READ_ONCE(wq_cpu);
+
+	if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu))
+		return queue_work_on(cpu, switch2_wq, work);
+	return queue_work(switch2_wq, work);
+}
+EXPORT_SYMBOL_GPL(switch2_queue_work);
+
 static const uint8_t switch2_init_cmd_data[] = {
 	/*
 	 * The last 6 bytes of this packet are the MAC address of
@@ -184,21 +526,26 @@ static const uint8_t switch2_init_cmd_data[] = {
 };
 
 static const uint8_t switch2_one_data[] = { 0x01, 0x00, 0x00, 0x00 };
+static const uint8_t switch2_unified_report_data[] = { NS2_REPORT_UNIFIED, 0x00, 0x00, 0x00 };
 #ifdef CONFIG_SWITCH2_FF
 static const uint8_t switch2_zero_data[] = { 0x00, 0x00, 0x00, 0x00 };
 #endif
 
-static const uint8_t switch2_player_pattern[] = { 0x1, 0x3, 0x7, 0xf, 0x9, 0x5, 0xd, 0x6 };
-
-static const uint8_t switch2_feature_mask[] = {
-	NS2_FEATURE_BUTTONS | NS2_FEATURE_ANALOG | NS2_FEATURE_IMU | NS2_FEATURE_RUMBLE,
-	0x00, 0x00, 0x00
+/*
+ * The first eight are the console's own player patterns. Past those, the four
+ * LEDs still have seven combinations the console doesn't use, which keep
+ * players up to 15 apart; after that the patterns repeat.
+ */
+static const uint8_t switch2_player_pattern[] = {
+	0x1, 0x3, 0x7, 0xf, 0x9, 0x5, 0xd, 0x6,
+	0x2, 0x4, 0x8, 0xa, 0xc, 0xe, 0xb,
 };
 
 static DEFINE_IDA(switch2_player_id_allocator);
 
 #ifdef CONFIG_SWITCH2_FF
-static void switch2_encode_rumble(struct switch2_hd_rumble *rumble, uint8_t buffer[5])
+VISIBLE_IF_KUNIT void switch2_encode_rumble(const struct switch2_hd_rumble *rumble,
+	uint8_t buffer[5])
 {
 	buffer[0] = rumble->hi_freq;
 	buffer[1] = (rumble->hi_freq >> 8) | (rumble->hi_amp << 2);
@@ -206,662 +553,3693 @@ static void switch2_encode_rumble(struct switch2_hd_rumble *rumble, uint8_t buff
 	buffer[3] = (rumble->lo_freq >> 4) | (rumble->lo_amp << 6);
 	buffer[4] = rumble->lo_amp >> 2;
 }
+EXPORT_SYMBOL_IF_KUNIT(switch2_encode_rumble);
+
+/* Must be called with rumble_lock held */
+static void switch2_set_rumble(struct switch2_controller *ns2, uint16_t strong, uint16_t weak)
+{
+	if (ns2->ctlr_type == NS2_CTLR_TYPE_GC) {
+		ns2->rumble.sd.amplitude = max(strong, weak >> 1);
+	} else {
+		ns2->rumble.hd.hi_amp = weak * RUMBLE_MAX >> 16;
+		ns2->rumble.hd.lo_amp = strong * RUMBLE_MAX >> 16;
+	}
+}
+
+/*
+ * A custom waveform is a series of samples of four values each: high band
+ * frequency and amplitude, then low band frequency and amplitude. Frequencies
+ * are the controller's own 10-bit encoding; amplitudes run from 0 to 0x7fff
+ * and are scaled to RUMBLE_MAX. Each sample lasts one rumble period.
+ */
+static struct switch2_hd_rumble *switch2_copy_waveform(const struct ff_periodic_effect *periodic,
+	unsigned int *samples)
+{
+	struct switch2_hd_rumble *waveform;
+	unsigned int i;
+	s16 *data;
+
+	if (!periodic->custom_len || periodic->custom_len % 4 ||
+	    periodic->custom_len / 4 > NS2_WAVEFORM_MAX_SAMPLES)
+		return ERR_PTR(-EINVAL);
+
+	data = memdup_array_user(periodic->custom_data, periodic->custom_len, sizeof(*data));
+	if (IS_ERR(data))
+		return ERR_CAST(data);
+
+	*samples = periodic->custom_len / 4;
+	waveform = kcalloc(*samples, sizeof(*waveform), GFP_KERNEL);
+	if (!waveform) {
+		kfree(data);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < *samples; i++) {
+		const s16 *sample = &data[i * 4];
+
+		waveform[i].hi_freq = clamp_t(s16, sample[0], 0, 0x3ff);
+		waveform[i].hi_amp = clamp_t(s16, sample[1], 0, S16_MAX) * RUMBLE_MAX >> 15;
+		waveform[i].lo_freq = clamp_t(s16, sample[2], 0, 0x3ff);
+		waveform[i].lo_amp = clamp_t(s16, sample[3], 0, S16_MAX) * RUMBLE_MAX >> 15;
+	}
+	kfree(data);
+	return waveform;
+}
 
-static int switch2_play_effect(struct input_dev *dev, void *data, struct ff_effect *effect)
+static int switch2_ff_upload(struct input_dev *dev, struct ff_effect *effect,
+	struct ff_effect *old)
 {
 	struct switch2_controller *ns2 = input_get_drvdata(dev);
+	struct switch2_ff_effect *slot = &ns2->ff_effects[effect->id];
+	struct switch2_hd_rumble *waveform = NULL;
+	unsigned int samples = 0;
 
-	if (effect->type != FF_RUMBLE)
-		return 0;
+	switch (effect->type) {
+	case FF_RUMBLE:
+		break;
+	case FF_PERIODIC:
+		if (effect->u.periodic.waveform != FF_CUSTOM || !ns2->waveform)
+			return -EINVAL;
+		waveform = switch2_copy_waveform(&effect->u.periodic, &samples);
+		if (IS_ERR(waveform))
+			return PTR_ERR(waveform);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock) {
+		swap(slot->waveform, waveform);
+		slot->samples = samples;
+		slot->length = effect->replay.length;
+		if (effect->type == FF_RUMBLE) {
+			slot->strong = effect->u.rumble.strong_magnitude;
+			slot->weak = effect->u.rumble.weak_magnitude;
+		} else {
+			slot->strong = 0;
+			slot->weak = 0;
+		}
+	}
+	kfree(waveform);
+	return 0;
+}
+
+static int switch2_ff_erase(struct input_dev *dev, int effect_id)
+{
+	struct switch2_controller *ns2 = input_get_drvdata(dev);
+	struct switch2_ff_effect *slot = &ns2->ff_effects[effect_id];
+	struct switch2_hd_rumble *waveform;
+
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock) {
+		waveform = slot->waveform;
+		memset(slot, 0, sizeof(*slot));
+	}
+	kfree(waveform);
+	return 0;
+}
+
+/* Free effects left behind by a device that went away with them uploaded */
+static void switch2_ff_free_effects(struct switch2_controller *ns2)
+{
+	int i;
+
+	for (i = 0; i < NS2_FF_EFFECTS; i++) {
+		kfree(ns2->ff_effects[i].waveform);
+		ns2->ff_effects[i].waveform = NULL;
+	}
+}
+
+/* Must be called with rumble_lock held. Anything that doesn't fit is dropped. */
+static void switch2_queue_waveform(struct switch2_controller *ns2,
+	const struct switch2_ff_effect *slot, int repeat)
+{
+	unsigned int i;
+
+	while (repeat--) {
+		for (i = 0; i < slot->samples; i++) {
+			if (ns2->waveform_head - ns2->waveform_tail == NS2_WAVEFORM_RING)
+				return;
+			ns2->waveform[ns2->waveform_head++ % NS2_WAVEFORM_RING] = slot->waveform[i];
+		}
+	}
+}
+
+static int switch2_ff_playback(struct input_dev *dev, int effect_id, int value)
+{
+	struct switch2_controller *ns2 = input_get_drvdata(dev);
+	struct switch2_ff_effect *slot = &ns2->ff_effects[effect_id];
 
 	guard(spinlock_irqsave)(&ns2->rumble_lock);
-	if (ns2->ctlr_type == NS2_CTLR_TYPE_GC) {
-		ns2->rumble.sd.amplitude = max(effect->u.rumble.strong_magnitude,
-			effect->u.rumble.weak_magnitude >> 1);
+	/* Unregistering the input device stops every effect, after the teardown */
+	if (ns2->rumble_dead)
+		return 0;
+
+	if (slot->waveform) {
+		trace_switch2_play_effect(ns2->phys, 0, 0);
+		if (value)
+			switch2_queue_waveform(ns2, slot, value);
+		else
+			ns2->waveform_tail = ns2->waveform_head;
 	} else {
-		ns2->rumble.hd.hi_amp = effect->u.rumble.weak_magnitude * RUMBLE_MAX >> 16;
-		ns2->rumble.hd.lo_amp = effect->u.rumble.strong_magnitude * RUMBLE_MAX >> 16;
+		trace_switch2_play_effect(ns2->phys, value ? slot->strong : 0,
+			value ? slot->weak : 0);
+		switch2_set_rumble(ns2, value ? slot->strong : 0, value ? slot->weak : 0);
+		ns2->rumble_end = value && slot->length ?
+			ktime_add_ms(ktime_get(), slot->length) : 0;
 	}
 
-	schedule_delayed_work(&ns2->rumble_work, 0);
+	if (!ns2->rumble_running && !READ_ONCE(ns2->suspended)) {
+		ns2->rumble_running = true;
+		ns2->rumble_ticks = 1;
+		hrtimer_start(&ns2->rumble_timer, 0, HRTIMER_MODE_REL_SOFT);
+	}
 
 	return 0;
 }
 
-static void switch2_rumble_work(struct work_struct *work)
+#define NS2_HD_RUMBLE_HEADER(count, seq) (0x40 | (count) << 4 | (seq))
+
+/*
+ * Fill one LRA block: a header with the sequence number and sample count,
+ * then up to three samples. Queued waveform samples take priority over the
+ * FF_RUMBLE state; samples for periods we were too late to send are dropped so
+ * the waveform stays in time. Must be called with rumble_lock held.
+ */
+static bool switch2_fill_hd_rumble(struct switch2_controller *ns2, uint8_t *block,
+	unsigned int ticks)
 {
-	struct switch2_controller *ns2 = container_of(to_delayed_work(work),
-						      struct switch2_controller, rumble_work);
-	unsigned long current_ms = jiffies_to_msecs(get_jiffies_64());
-	uint8_t *buffer = kzalloc(64, GFP_KERNEL);
-	unsigned long flags;
-	bool active;
-	int ret;
+	unsigned int queued = ns2->waveform_head - ns2->waveform_tail;
+	unsigned int count, skip, i;
 
-	if (!buffer)
-		return;
+	skip = min((ticks - 1) * NS2_HD_SAMPLES_PER_FRAME, queued);
+	ns2->waveform_tail += skip;
+	queued -= skip;
 
-	spin_lock_irqsave(&ns2->rumble_lock, flags);
-	buffer[0x1] = 0x50 | ns2->rumble_seq;
+	count = min(queued, NS2_HD_SAMPLES_PER_FRAME);
+	if (!count) {
+		block[0] = NS2_HD_RUMBLE_HEADER(1, ns2->rumble_seq);
+		switch2_encode_rumble(&ns2->rumble.hd, &block[1]);
+		return ns2->rumble.hd.hi_amp || ns2->rumble.hd.lo_amp;
+	}
+
+	block[0] = NS2_HD_RUMBLE_HEADER(count, ns2->rumble_seq);
+	for (i = 0; i < count; i++)
+		switch2_encode_rumble(&ns2->waveform[(ns2->waveform_tail + i) % NS2_WAVEFORM_RING],
+			&block[1 + i * 5]);
+	ns2->waveform_tail += count;
+	return true;
+}
+
+/*
+ * Must be called with rumble_lock held. @ticks is how many scheduler ticks
+ * this frame covers, so that the ERM duty cycle and HD waveforms stay right if
+ * the scheduler fell behind. Returns whether rumble is still playing.
+ */
+VISIBLE_IF_KUNIT bool switch2_fill_rumble(struct switch2_controller *ns2, uint8_t *buffer,
+	unsigned int ticks)
+{
+	bool active;
+
+	memset(buffer, 0, NS2_RUMBLE_SIZE);
 	if (ns2->ctlr_type == NS2_CTLR_TYPE_GC) {
+		buffer[0x1] = 0x50 | ns2->rumble_seq;
 		buffer[0] = 3;
 		if (ns2->rumble.sd.amplitude == 0) {
 			buffer[2] = GC_RUMBLE_STOP;
 			ns2->rumble.sd.error = 0;
 			active = false;
 		} else {
-			if (ns2->rumble.sd.error < ns2->rumble.sd.amplitude) {
-				buffer[2] = GC_RUMBLE_ON;
-				ns2->rumble.sd.error += U16_MAX - ns2->rumble.sd.amplitude;
-			} else {
-				buffer[2] = GC_RUMBLE_OFF;
-				ns2->rumble.sd.error -= ns2->rumble.sd.amplitude;
-			}
+			do {
+				if (ns2->rumble.sd.error < ns2->rumble.sd.amplitude) {
+					buffer[2] = GC_RUMBLE_ON;
+					ns2->rumble.sd.error += U16_MAX - ns2->rumble.sd.amplitude;
+				} else {
+					buffer[2] = GC_RUMBLE_OFF;
+					ns2->rumble.sd.error -= ns2->rumble.sd.amplitude;
+				}
+			} while (--ticks);
 			active = true;
 		}
 	} else {
 		buffer[0] = 1;
-		switch2_encode_rumble(&ns2->rumble.hd, &buffer[0x2]);
-		active = ns2->rumble.hd.hi_amp || ns2->rumble.hd.lo_amp;
+		active = switch2_fill_hd_rumble(ns2, &buffer[0x1], ticks);
 		if (ns2->ctlr_type == NS2_CTLR_TYPE_PRO) {
 			/*
 			 * The Pro Controller contains separate LRAs on each
 			 * side that can be controlled individually.
 			 */
 			buffer[0] = 2;
-			buffer[0x11] = 0x50 | ns2->rumble_seq;
-			switch2_encode_rumble(&ns2->rumble.hd, &buffer[0x12]);
+			memcpy(&buffer[0x11], &buffer[0x1], 0x10);
 		}
 	}
 	ns2->rumble_seq = (ns2->rumble_seq + 1) & 0xF;
 
-	if (active) {
-		unsigned long interval = msecs_to_jiffies(4);
+	return active;
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_fill_rumble);
 
-		if (!ns2->last_rumble_work)
-			ns2->last_rumble_work = current_ms;
-		else
-			ns2->last_rumble_work += interval;
-		schedule_delayed_work(&ns2->rumble_work,
-			ns2->last_rumble_work + interval - current_ms);
-	} else {
-		ns2->last_rumble_work = 0;
-	}
-	spin_unlock_irqrestore(&ns2->rumble_lock, flags);
+static void switch2_rumble_complete(struct urb *urb)
+{
+	struct switch2_rumble_frame *frame = urb->context;
 
-	if (!ns2->hdev) {
-		cancel_delayed_work(&ns2->rumble_work);
-		ret = -ENODEV;
-	} else {
-		ret = hid_hw_output_report(ns2->hdev, buffer, 64);
+	trace_switch2_rumble_done(frame->parent->phys, frame->seq, urb->status);
+
+	switch (urb->status) {
+	case 0:
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		break;
+	default:
+		dev_dbg(&urb->dev->dev, "rumble urb status: %d\n", urb->status);
+		break;
 	}
 
-	kfree(buffer);
-	if (ret < 0)
-		hid_dbg(ns2->hdev, "Failed to send output report ret=%d\n", ret);
+	WRITE_ONCE(frame->busy, false);
 }
-#endif
 
-struct switch2_controller *switch2_get_controller(const char *phys)
+/*
+ * Rumble is sent from one of a small ring of preallocated frames straight to
+ * the HID interface's interrupt OUT endpoint, so the tick never allocates. If
+ * the endpoint couldn't be found, the frame is handed to rumble_work to go
+ * through hid_hw_output_report(), which may sleep.
+ */
+static int switch2_send_rumble(struct switch2_controller *ns2,
+	struct switch2_rumble_frame *frame)
 {
-	struct switch2_controller *ns2;
+	int ret;
 
-	guard(mutex)(&switch2_controllers_lock);
-	list_for_each_entry(ns2, &switch2_controllers, entry) {
-		if (strncmp(ns2->phys, phys, sizeof(ns2->phys)) == 0)
-			return ns2;
+	WRITE_ONCE(frame->busy, true);
+	if (!frame->urb) {
+		switch2_queue_work(&ns2->rumble_work);
+		return 0;
 	}
-	ns2 = kzalloc(sizeof(*ns2), GFP_KERNEL);
-	if (!ns2)
-		return ERR_PTR(-ENOMEM);
 
-	mutex_init(&ns2->lock);
-	INIT_LIST_HEAD(&ns2->entry);
-	list_add(&ns2->entry, &switch2_controllers);
-	strscpy(ns2->phys, phys, sizeof(ns2->phys));
-	return ns2;
+	ret = usb_submit_urb(frame->urb, GFP_ATOMIC);
+	if (ret)
+		WRITE_ONCE(frame->busy, false);
+	return ret;
 }
-EXPORT_SYMBOL_GPL(switch2_get_controller);
 
-void switch2_controller_put(struct switch2_controller *ns2)
+static void switch2_rumble_work(struct work_struct *work)
 {
-	mutex_lock(&ns2->lock);
-	if (ns2->input) {
-		input_unregister_device(ns2->input);
-		ns2->input = NULL;
-	}
-	ns2->init_step = 0;
-	if (ns2->hdev || ns2->cfg) {
-		mutex_unlock(&ns2->lock);
-		return;
+	struct switch2_controller *ns2 = container_of(work, struct switch2_controller,
+		rumble_work);
+	unsigned int first;
+	unsigned int i;
+	int ret;
+
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+		first = ns2->rumble_next;
+
+	/* Oldest first, which is the slot the scheduler fills next */
+	for (i = 0; i < NS2_RUMBLE_FRAMES; i++) {
+		struct switch2_rumble_frame *frame =
+			&ns2->rumble_frames[(first + i) % NS2_RUMBLE_FRAMES];
+
+		if (!READ_ONCE(frame->busy))
+			continue;
+
+		ret = hid_hw_output_report(ns2->hdev, frame->data, NS2_RUMBLE_SIZE);
+		if (ret < 0)
+			hid_dbg(ns2->hdev, "Failed to send output report ret=%d\n", ret);
+		WRITE_ONCE(frame->busy, false);
 	}
-	mutex_unlock(&ns2->lock);
-	mutex_destroy(&ns2->lock);
+}
+
+static unsigned int rumble_period_us = 4000;
+module_param(rumble_period_us, uint, 0644);
+MODULE_PARM_DESC(rumble_period_us,
+	"Interval between rumble frames in microseconds (1000-50000, default 4000)");
 
-	mutex_lock(&switch2_controllers_lock);
-	list_del_init(&ns2->entry);
-	mutex_unlock(&switch2_controllers_lock);
-	kfree(ns2);
+static ktime_t switch2_rumble_period(void)
+{
+	return us_to_ktime(clamp(READ_ONCE(rumble_period_us), 1000u, 50000u));
 }
-EXPORT_SYMBOL_GPL(switch2_controller_put);
 
-static bool switch2_parse_stick_calibration(struct switch2_stick_calibration *calib,
-	const uint8_t *data)
+/*
+ * Rumble frames are paced by an hrtimer rather than delayed work, since
+ * jiffies can't express a 4 ms period on most HZ settings. The timer is
+ * forwarded on its own grid, so a late tick never shifts the ones after it:
+ * it sends one frame covering every period it missed and counts them.
+ */
+static enum hrtimer_restart switch2_rumble_timer(struct hrtimer *timer)
 {
-	static const uint8_t UNCALIBRATED[9] = {
-		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
-	};
-	if (memcmp(UNCALIBRATED, data, sizeof(UNCALIBRATED)) == 0)
-		return false;
+	struct switch2_controller *ns2 = container_of(timer, struct switch2_controller,
+		rumble_timer);
+	struct switch2_rumble_frame *frame;
+	unsigned int periods = 1;
+	unsigned long flags;
+	unsigned int ticks;
+	uint8_t seq;
+	bool active;
+	u64 overruns;
+	int ret;
 
-	calib->x.neutral = data[0];
-	calib->x.neutral |= (data[1] & 0x0F) << 8;
+	spin_lock_irqsave(&ns2->rumble_lock, flags);
+	if (ns2->rumble_dead) {
+		ns2->rumble_running = false;
+		spin_unlock_irqrestore(&ns2->rumble_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	if (ns2->rumble_end && ktime_after(ktime_get(), ns2->rumble_end)) {
+		switch2_set_rumble(ns2, 0, 0);
+		ns2->rumble_end = 0;
+	}
+	frame = &ns2->rumble_frames[ns2->rumble_next];
+	seq = ns2->rumble_seq;
+	ticks = ns2->rumble_ticks;
+	if (READ_ONCE(frame->busy)) {
+		/* The previous frame in this slot is still on the wire */
+		frame = NULL;
+		active = true;
+	} else {
+		frame->seq = seq;
+		active = switch2_fill_rumble(ns2, frame->data, ticks);
+		ns2->rumble_next = (ns2->rumble_next + 1) % NS2_RUMBLE_FRAMES;
+		ns2->rumble_ticks = 0;
+	}
+	/* While a waveform streams, each frame carries several periods of it */
+	if (ns2->waveform_head != ns2->waveform_tail)
+		periods = NS2_HD_SAMPLES_PER_FRAME;
+	/* From here on a new effect starts the timer afresh instead of relying on us */
+	if (!active)
+		ns2->rumble_running = false;
+	spin_unlock_irqrestore(&ns2->rumble_lock, flags);
 
-	calib->y.neutral = data[1] >> 4;
-	calib->y.neutral |= data[2] << 4;
+	trace_switch2_rumble_frame(ns2->phys, seq, ticks, frame != NULL);
 
-	calib->x.positive = data[3];
-	calib->x.positive |= (data[4] & 0x0F) << 8;
+	if (frame) {
+		ret = switch2_send_rumble(ns2, frame);
+		if (ret < 0)
+			hid_dbg(ns2->hdev, "Failed to send output report ret=%d\n", ret);
+	}
 
-	calib->y.positive = data[4] >> 4;
-	calib->y.positive |= data[5] << 4;
+	if (!active)
+		return HRTIMER_NORESTART;
 
-	calib->x.negative = data[6];
-	calib->x.negative |= (data[7] & 0x0F) << 8;
+	overruns = hrtimer_forward_now(timer, switch2_rumble_period() * periods);
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+		ns2->rumble_ticks += overruns;
+	switch2_stat_add(ns2, rumble_ticks, overruns);
+	if (overruns > 1)
+		switch2_stat_add(ns2, rumble_missed, overruns - 1);
+	return HRTIMER_RESTART;
+}
 
-	calib->y.negative = data[7] >> 4;
-	calib->y.negative |= data[8] << 4;
+#ifdef CONFIG_PM
+/* Silence the motors and wait for the frames on the wire, keeping the URBs */
+static void switch2_park_rumble(struct switch2_controller *ns2)
+{
+	int i;
 
-	return true;
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock) {
+		switch2_set_rumble(ns2, 0, 0);
+		ns2->rumble_end = 0;
+		ns2->waveform_tail = ns2->waveform_head;
+	}
+	hrtimer_cancel(&ns2->rumble_timer);
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+		ns2->rumble_running = false;
+	cancel_work_sync(&ns2->rumble_work);
+	for (i = 0; i < NS2_RUMBLE_FRAMES; i++) {
+		if (ns2->rumble_frames[i].urb)
+			usb_kill_urb(ns2->rumble_frames[i].urb);
+	}
 }
+#endif
 
-static void switch2_handle_flash_read(struct switch2_controller *ns2, uint8_t size,
-	uint32_t address, const uint8_t *data)
+static void switch2_free_rumble(struct switch2_controller *ns2)
 {
-	bool ok;
+	struct usb_device *udev = hid_to_usb_dev(ns2->hdev);
+	struct switch2_hd_rumble *waveform;
+	int i;
 
-	switch (address) {
-	case NS2_FLASH_ADDR_SERIAL:
-		if (size != NS2_FLASH_SIZE_SERIAL)
-			return;
-		memcpy(ns2->serial, data, size);
-		break;
-	case NS2_FLASH_ADDR_FACTORY_PRIMARY_CALIB:
-		if (size != NS2_FLASH_SIZE_FACTORY_AXIS_CALIB)
-			return;
-		ok = switch2_parse_stick_calibration(&ns2->stick_calib[0], data);
-		if (ok) {
-			hid_dbg(ns2->hdev, "Got factory primary stick calibration:\n");
-			hid_dbg(ns2->hdev, "Left max: %i, neutral: %i, right max: %i\n",
-				ns2->stick_calib[0].x.negative,
-				ns2->stick_calib[0].x.neutral,
-				ns2->stick_calib[0].x.positive);
-			hid_dbg(ns2->hdev, "Down max: %i, neutral: %i, up max: %i\n",
-				ns2->stick_calib[0].y.negative,
-				ns2->stick_calib[0].y.neutral,
-				ns2->stick_calib[0].y.positive);
+	for (i = 0; i < NS2_RUMBLE_FRAMES; i++) {
+		struct switch2_rumble_frame *frame = &ns2->rumble_frames[i];
+
+		if (frame->urb) {
+			usb_kill_urb(frame->urb);
+			usb_free_coherent(udev, NS2_RUMBLE_SIZE, frame->data,
+				frame->urb->transfer_dma);
+			usb_free_urb(frame->urb);
 		} else {
-			hid_dbg(ns2->hdev, "Factory primary stick calibration not present\n");
+			kfree(frame->data);
 		}
-		break;
-	case NS2_FLASH_ADDR_FACTORY_SECONDARY_CALIB:
-		if (size != NS2_FLASH_SIZE_FACTORY_AXIS_CALIB)
-			return;
-		ok = switch2_parse_stick_calibration(&ns2->stick_calib[1], data);
-		if (ok) {
-			hid_dbg(ns2->hdev, "Got factory secondary stick calibration:\n");
-			hid_dbg(ns2->hdev, "Left max: %i, neutral: %i, right max: %i\n",
-				ns2->stick_calib[1].x.negative,
-				ns2->stick_calib[1].x.neutral,
-				ns2->stick_calib[1].x.positive);
-			hid_dbg(ns2->hdev, "Down max: %i, neutral: %i, up max: %i\n",
-				ns2->stick_calib[1].y.negative,
-				ns2->stick_calib[1].y.neutral,
-				ns2->stick_calib[1].y.positive);
-		} else {
-			hid_dbg(ns2->hdev, "Factory secondary stick calibration not present\n");
-		}
-		break;
-	case NS2_FLASH_ADDR_FACTORY_TRIGGER_CALIB:
-		if (size != NS2_FLASH_SIZE_FACTORY_TRIGGER_CALIB)
-			return;
-		if (data[0] != 0xFF && data[1] != 0xFF) {
-			ns2->lt_zero = data[0];
-			ns2->rt_zero = data[1];
+		frame->urb = NULL;
+		frame->data = NULL;
+		frame->busy = false;
+	}
 
-			hid_dbg(ns2->hdev, "Got factory trigger calibration:\n");
-			hid_dbg(ns2->hdev, "Left zero point: %i\n", ns2->lt_zero);
-			hid_dbg(ns2->hdev, "Right zero point: %i\n", ns2->rt_zero);
-		} else {
-			hid_dbg(ns2->hdev, "Factory trigger calibration not present\n");
-		}
-		break;
-	case NS2_FLASH_ADDR_USER_PRIMARY_CALIB:
-		if (size != NS2_FLASH_SIZE_USER_AXIS_CALIB)
-			return;
-		if (__le16_to_cpu(*(__le16 *)data) != NS2_USER_CALIB_MAGIC) {
-			hid_dbg(ns2->hdev, "No user primary stick calibration present\n");
-			break;
-		}
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock) {
+		waveform = ns2->waveform;
+		ns2->waveform = NULL;
+		ns2->waveform_tail = ns2->waveform_head;
+	}
+	kfree(waveform);
+}
 
-		ok = switch2_parse_stick_calibration(&ns2->stick_calib[0], &data[2]);
-		if (ok) {
-			hid_dbg(ns2->hdev, "Got user primary stick calibration:\n");
-			hid_dbg(ns2->hdev, "Left max: %i, neutral: %i, right max: %i\n",
-				ns2->stick_calib[0].x.negative,
-				ns2->stick_calib[0].x.neutral,
-				ns2->stick_calib[0].x.positive);
-			hid_dbg(ns2->hdev, "Down max: %i, neutral: %i, up max: %i\n",
-				ns2->stick_calib[0].y.negative,
-				ns2->stick_calib[0].y.neutral,
-				ns2->stick_calib[0].y.positive);
-		} else {
-			hid_dbg(ns2->hdev, "No user primary stick calibration present\n");
-		}
-		break;
-	case NS2_FLASH_ADDR_USER_SECONDARY_CALIB:
-		if (size != NS2_FLASH_SIZE_USER_AXIS_CALIB)
-			return;
-		if (__le16_to_cpu(*(__le16 *)data) != NS2_USER_CALIB_MAGIC) {
-			hid_dbg(ns2->hdev, "No user secondary stick calibration present\n");
-			break;
+static int switch2_alloc_rumble(struct switch2_controller *ns2)
+{
+	struct hid_device *hdev = ns2->hdev;
+	struct usb_interface *intf = to_usb_interface(hdev->dev.parent);
+	struct usb_device *udev = hid_to_usb_dev(hdev);
+	struct usb_endpoint_descriptor *ep_out;
+	int i;
+
+	ns2->rumble_next = 0;
+	/* The type may not be known before init, but the product always is */
+	if (hdev->product != USB_DEVICE_ID_NINTENDO_NS2_GCCON) {
+		ns2->waveform = kcalloc(NS2_WAVEFORM_RING, sizeof(*ns2->waveform), GFP_KERNEL);
+		if (!ns2->waveform)
+			return -ENOMEM;
+	}
+
+	if (usb_find_int_out_endpoint(intf->cur_altsetting, &ep_out)) {
+		hid_dbg(hdev, "No interrupt OUT endpoint, sending rumble via HID core\n");
+		ep_out = NULL;
+	}
+
+	for (i = 0; i < NS2_RUMBLE_FRAMES; i++) {
+		struct switch2_rumble_frame *frame = &ns2->rumble_frames[i];
+
+		frame->parent = ns2;
+		frame->busy = false;
+		if (!ep_out) {
+			frame->data = kzalloc(NS2_RUMBLE_SIZE, GFP_KERNEL);
+			if (!frame->data)
+				goto err_free;
+			continue;
 		}
 
-		ok = switch2_parse_stick_calibration(&ns2->stick_calib[1], &data[2]);
-		if (ok) {
-			hid_dbg(ns2->hdev, "Got user secondary stick calibration:\n");
-			hid_dbg(ns2->hdev, "Left max: %i, neutral: %i, right max: %i\n",
-				ns2->stick_calib[1].x.negative,
-				ns2->stick_calib[1].x.neutral,
-				ns2->stick_calib[1].x.positive);
-			hid_dbg(ns2->hdev, "Down max: %i, neutral: %i, up max: %i\n",
-				ns2->stick_calib[1].y.negative,
-				ns2->stick_calib[1].y.neutral,
-				ns2->stick_calib[1].y.positive);
-		} else {
-			hid_dbg(ns2->hdev, "No user secondary stick calibration present\n");
+		frame->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!frame->urb)
+			goto err_free;
+
+		frame->data = usb_alloc_coherent(udev, NS2_RUMBLE_SIZE, GFP_KERNEL,
+			&frame->urb->transfer_dma);
+		if (!frame->data) {
+			usb_free_urb(frame->urb);
+			frame->urb = NULL;
+			goto err_free;
 		}
-		break;
+
+		usb_fill_int_urb(frame->urb, udev,
+			usb_sndintpipe(udev, ep_out->bEndpointAddress),
+			frame->data, NS2_RUMBLE_SIZE, switch2_rumble_complete, frame,
+			ep_out->bInterval);
+		frame->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	}
+	return 0;
+
+err_free:
+	switch2_free_rumble(ns2);
+	return -ENOMEM;
 }
+#endif
 
-int switch2_receive_command(struct switch2_controller *ns2,
-	const uint8_t *message, size_t length)
+#define NS2_CMD_TIMEOUT		msecs_to_jiffies(250)
+#define NS2_CMD_ATTEMPTS	3
+
+static int switch2_cmd_transmit(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req)
 {
-	const struct switch2_cmd_header *header;
+	int ret;
 
-	if (length < 8)
+	req->attempts++;
+	req->deadline = jiffies + NS2_CMD_TIMEOUT;
+	req->sent = ktime_get();
+	/* The reply can be matched from the transport's completion before send_command() returns */
+	scoped_guard(spinlock_irqsave, &ns2->cmd_lock)
+		list_move_tail(&req->entry, &ns2->cmd_pending);
+	ret = ns2->cfg->send_command(req->command, req->subcommand, req->message,
+		req->length, ns2->cfg);
+	if (ret < 0) {
+		scoped_guard(spinlock_irqsave, &ns2->cmd_lock)
+			list_del_init(&req->entry);
+	}
+	return ret;
+}
+
+static void switch2_cmd_finish(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, int status, const uint8_t *reply, size_t length)
+{
+	scoped_guard(spinlock_irqsave, &ns2->cmd_lock)
+		list_del_init(&req->entry);
+	req->status = status;
+	if (req->complete)
+		req->complete(ns2, req, reply, length);
+	complete_all(&req->done);
+}
+
+/*
+ * Send a command and track it until its response arrives. If @req is NULL the
+ * command is sent without waiting for anything. Must be called with the
+ * controller lock held.
+ */
+static int switch2_cmd_send(struct switch2_controller *ns2, struct switch2_cmd_request *req,
+	enum switch2_cmd command, uint8_t subcommand, const void *message, size_t length)
+{
+	int ret;
+
+	lockdep_assert_held(&ns2->lock);
+
+	if (!ns2->cfg)
+		return -ENOTCONN;
+	if (ns2->suspended)
+		return -EAGAIN;
+	if (!req)
+		return ns2->cfg->send_command(command, subcommand, message, length, ns2->cfg);
+	if (WARN_ON(length > sizeof(req->message)))
 		return -EINVAL;
 
-	print_hex_dump_debug("got cmd: ", DUMP_PREFIX_OFFSET, 16, 1, message, length, false);
+	req->command = command;
+	req->subcommand = subcommand;
+	if (length)
+		memcpy(req->message, message, length);
+	req->length = length;
+	req->address = 0;
+	if (command == NS2_CMD_FLASH && subcommand == NS2_SUBCMD_FLASH_READ)
+		req->address = get_unaligned_le32(&req->message[4]);
+	req->attempts = 0;
+	req->status = -EINPROGRESS;
+	reinit_completion(&req->done);
+	req->queued = ktime_get();
 
-	guard(mutex)(&ns2->lock);
-	if (ns2->init_step < NS2_INIT_DONE)
-		switch2_init_controller(ns2);
+	/* Once transmitted, @req may already be answered and reused */
+	queue_delayed_work(switch2_wq, &ns2->cmd_timeout_work, NS2_CMD_TIMEOUT);
+	ret = switch2_cmd_transmit(ns2, req);
+	return ret < 0 ? ret : 0;
+}
 
-	header = (const struct switch2_cmd_header *)message;
-	message = &message[8];
-	switch (header->command) {
-	case NS2_CMD_FLASH:
-		if (header->subcommand == NS2_SUBCMD_FLASH_READ) {
-			uint8_t read_size;
-			uint32_t read_address;
+/* Resend @req, or fail it with @status once it is out of attempts */
+static void switch2_cmd_retry(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, int status)
+{
+	if (status == -ETIMEDOUT)
+		switch2_stat_inc(ns2, cmd_timeouts);
+	if (req->attempts < NS2_CMD_ATTEMPTS && ns2->cfg) {
+		switch2_stat_inc(ns2, cmd_retries);
+		switch2_dbg(ns2, "Retrying command %02x:%02x (%d)\n", req->command,
+			req->subcommand, status);
+		if (switch2_cmd_transmit(ns2, req) >= 0)
+			return;
+	}
+	if (status == -ETIMEDOUT)
+		switch2_warn(ns2, "Command %02x:%02x timed out\n", req->command,
+			req->subcommand);
+	else
+		switch2_dbg(ns2, "Command %02x:%02x failed: %d\n", req->command,
+			req->subcommand, status);
+	switch2_cmd_finish(ns2, req, status, NULL, 0);
+}
 
-			if (length < 16)
-				return -EINVAL;
-			read_size = message[0];
-			read_address = __le32_to_cpu(*(__le32 *)&message[4]);
-			if (length < read_size + 16)
-				return -EINVAL;
-			switch2_handle_flash_read(ns2, read_size, read_address, &message[8]);
+/* Must be called with cmd_lock held. Returns the oldest request @header answers. */
+static struct switch2_cmd_request *switch2_cmd_find(struct switch2_controller *ns2,
+	const struct switch2_cmd_header *header, const uint8_t *message, size_t length)
+{
+	struct switch2_cmd_request *req;
+
+	lockdep_assert_held(&ns2->cmd_lock);
+
+	list_for_each_entry(req, &ns2->cmd_pending, entry) {
+		if (req->command != header->command || req->subcommand != header->subcommand)
+			continue;
+		if (req->command == NS2_CMD_FLASH && req->subcommand == NS2_SUBCMD_FLASH_READ &&
+		    (length < 8 || get_unaligned_le32(&message[4]) != req->address))
+			continue;
+		return req;
+	}
+	return NULL;
+}
+
+static void switch2_cmd_account_rtt(struct switch2_controller *ns2,
+	const struct switch2_cmd_request *req)
+{
+	u64 rtt = ktime_us_delta(ktime_get(), req->sent);
+
+	switch2_stat_inc(ns2, cmd_rtt[min_t(unsigned int, fls64(rtt),
+		NS2_STATS_RTT_BUCKETS - 1)]);
+}
+
+/* Unlinks and returns the oldest request @header answers, if any */
+static struct switch2_cmd_request *switch2_cmd_claim(struct switch2_controller *ns2,
+	const struct switch2_cmd_header *header, const uint8_t *message, size_t length)
+{
+	struct switch2_cmd_request *req;
+
+	guard(spinlock_irqsave)(&ns2->cmd_lock);
+	req = switch2_cmd_find(ns2, header, message, length);
+	if (req)
+		list_del_init(&req->entry);
+	return req;
+}
+
+/* Must be called with the controller lock held, on a request from switch2_cmd_claim() */
+static void switch2_cmd_answer(struct switch2_controller *ns2, struct switch2_cmd_request *req,
+	const struct switch2_cmd_header *header, const uint8_t *message, size_t length)
+{
+	if (header->direciton & NS2_FLAG_NACK) {
+		switch2_cmd_retry(ns2, req, -EIO);
+	} else {
+		switch2_cmd_account_rtt(ns2, req);
+		switch2_cmd_finish(ns2, req, 0, message, length);
+	}
+}
+
+static void switch2_cmd_timeout_work(struct work_struct *work)
+{
+	struct switch2_controller *ns2 = container_of(to_delayed_work(work),
+		struct switch2_controller, cmd_timeout_work);
+	struct switch2_cmd_request *req, *tmp;
+	unsigned long next = 0;
+	LIST_HEAD(expired);
+
+	guard(mutex)(&ns2->lock);
+	scoped_guard(spinlock_irqsave, &ns2->cmd_lock) {
+		list_for_each_entry_safe(req, tmp, &ns2->cmd_pending, entry) {
+			if (!time_before(jiffies, req->deadline))
+				list_move_tail(&req->entry, &expired);
 		}
-		break;
-	case NS2_CMD_FW_INFO:
-		if (header->subcommand == NS2_SUBCMD_FW_INFO_GET) {
-			if (length < sizeof(ns2->version))
-				return -EINVAL;
-			memcpy(&ns2->version, message, sizeof(ns2->version));
-			ns2->ctlr_type = ns2->version.ctlr_type;
+	}
+	list_for_each_entry_safe(req, tmp, &expired, entry)
+		switch2_cmd_retry(ns2, req, -ETIMEDOUT);
+
+	scoped_guard(spinlock_irqsave, &ns2->cmd_lock) {
+		list_for_each_entry(req, &ns2->cmd_pending, entry) {
+			if (!next || time_before(req->deadline, next))
+				next = req->deadline;
 		}
-		break;
-	default:
-		break;
 	}
+	if (next)
+		queue_delayed_work(switch2_wq, &ns2->cmd_timeout_work,
+			time_after(next, jiffies) ? next - jiffies : 0);
+
+	/* A step that gave up may have unblocked the ones after it */
+	if (ns2->cfg && !(ns2->init_done & BIT(NS2_INIT_DONE)))
+		switch2_init_controller(ns2);
+}
+
+/*
+ * Send a command and sleep until its response, or its last retry, is in. Must
+ * be called without the controller lock held.
+ */
+static int switch2_cmd_sync(struct switch2_controller *ns2, enum switch2_cmd command,
+	uint8_t subcommand, const void *message, size_t length)
+{
+	struct switch2_cmd_request req = {};
+	int ret;
+
+	INIT_LIST_HEAD(&req.entry);
+	init_completion(&req.done);
+	scoped_guard(mutex, &ns2->lock)
+		ret = switch2_cmd_send(ns2, &req, command, subcommand, message, length);
+	if (ret)
+		return ret;
+
+	wait_for_completion(&req.done);
+	return req.status;
+}
+
+/* Drop every outstanding request. Their callbacks are not run. */
+static void switch2_cmd_cancel_all(struct switch2_controller *ns2)
+{
+	struct switch2_cmd_request *req, *tmp;
+	LIST_HEAD(cancelled);
+
+	lockdep_assert_held(&ns2->lock);
+
+	scoped_guard(spinlock_irqsave, &ns2->cmd_lock)
+		list_splice_init(&ns2->cmd_pending, &cancelled);
+	list_for_each_entry_safe(req, tmp, &cancelled, entry) {
+		list_del_init(&req->entry);
+		req->status = -ECONNRESET;
+		complete_all(&req->done);
+	}
+}
+
+/*
+ * Turn the axis range into a multiply and shift so the input path doesn't need
+ * to divide. With s = 12 + ceil(log2(range)) and m = ceil(2^(s + 15) / range),
+ * (x * m) >> s equals x * 2^15 / range exactly for every 12-bit x, and m always
+ * fits in 32 bits.
+ */
+VISIBLE_IF_KUNIT void switch2_prepare_axis_range(uint16_t range, uint32_t *scale,
+	uint8_t *shift)
+{
+	*shift = 12 + order_base_2(range);
+	*scale = DIV_ROUND_UP_ULL(1ULL << (*shift + 15), range);
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_prepare_axis_range);
+
+static void switch2_prepare_axis_calibration(struct switch2_axis_calibration *calib)
+{
+	if (!calib->neutral || !calib->negative || !calib->positive) {
+		/* Uncalibrated: value = (raw - 2048) * 16 */
+		calib->center = 2048;
+		calib->negative_scale = 16;
+		calib->negative_shift = 0;
+		calib->positive_scale = 16;
+		calib->positive_shift = 0;
+		return;
+	}
+
+	calib->center = calib->neutral;
+	switch2_prepare_axis_range(calib->negative, &calib->negative_scale,
+		&calib->negative_shift);
+	switch2_prepare_axis_range(calib->positive, &calib->positive_scale,
+		&calib->positive_shift);
+}
+
+VISIBLE_IF_KUNIT void switch2_prepare_stick_calibration(struct switch2_stick_calibration *calib)
+{
+	switch2_prepare_axis_calibration(&calib->x);
+	switch2_prepare_axis_calibration(&calib->y);
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_prepare_stick_calibration);
+
+/* Publish the current calibration to the input path. Must be called with the lock held. */
+static int switch2_publish_calibration(struct switch2_controller *ns2)
+{
+	struct switch2_calibration *calib, *old;
+
+	calib = kmalloc(sizeof(*calib), GFP_KERNEL);
+	if (!calib)
+		return -ENOMEM;
+
+	memcpy(calib->stick, ns2->stick_calib, sizeof(calib->stick));
+	calib->lt_zero = ns2->lt_zero;
+	calib->rt_zero = ns2->rt_zero;
 
+	/* Readers may see @calib as soon as it is published, generation included */
+	old = rcu_dereference_protected(ns2->calib, lockdep_is_held(&ns2->lock));
+	calib->generation = old ? old->generation + 1 : 1;
+	rcu_assign_pointer(ns2->calib, calib);
+	if (old)
+		kfree_rcu(old, rcu);
 	return 0;
 }
-EXPORT_SYMBOL_GPL(switch2_receive_command);
 
-static int switch2_features_enable(struct switch2_controller *ns2, int features)
+static struct dentry *switch2_debugfs_root;
+
+static int switch2_stats_show(struct seq_file *s, void *unused)
 {
-	__le32 feature_bits = __cpu_to_le32(features);
+	struct switch2_controller *ns2 = s->private;
+	struct switch2_stats total = {};
+	int cpu;
+	int i;
 
-	if (!ns2->cfg)
-		return -ENOTCONN;
-	return ns2->cfg->send_command(NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_ENABLE,
-		&feature_bits, sizeof(feature_bits),
-		ns2->cfg);
+	for_each_possible_cpu(cpu) {
+		const struct switch2_stats *stats = per_cpu_ptr(ns2->stats, cpu);
+
+		for (i = 0; i < NS2_STATS_REPORT_IDS; i++)
+			total.reports[i] += stats->reports[i];
+		total.reports_deduped += stats->reports_deduped;
+		total.bulk_in_submit_failed += stats->bulk_in_submit_failed;
+		total.out_queue_full += stats->out_queue_full;
+		total.rumble_ticks += stats->rumble_ticks;
+		total.rumble_missed += stats->rumble_missed;
+		total.cmd_retries += stats->cmd_retries;
+		total.cmd_timeouts += stats->cmd_timeouts;
+		for (i = 0; i < NS2_STATS_RTT_BUCKETS; i++)
+			total.cmd_rtt[i] += stats->cmd_rtt[i];
+	}
+
+	for (i = 0; i < NS2_STATS_REPORT_IDS; i++)
+		if (total.reports[i])
+			seq_printf(s, "reports_%02x: %llu\n", i, total.reports[i]);
+	seq_printf(s, "reports_deduped: %llu\n", total.reports_deduped);
+	seq_printf(s, "bulk_in_submit_failed: %llu\n", total.bulk_in_submit_failed);
+	seq_printf(s, "out_queue_full: %llu\n", total.out_queue_full);
+	seq_printf(s, "rumble_ticks: %llu\n", total.rumble_ticks);
+	seq_printf(s, "rumble_missed: %llu\n", total.rumble_missed);
+	seq_printf(s, "cmd_retries: %llu\n", total.cmd_retries);
+	seq_printf(s, "cmd_timeouts: %llu\n", total.cmd_timeouts);
+	seq_puts(s, "cmd_rtt_us:\n");
+	for (i = 0; i < NS2_STATS_RTT_BUCKETS - 1; i++)
+		seq_printf(s, "  <%-6lu %llu\n", BIT(i), total.cmd_rtt[i]);
+	seq_printf(s, "  >=%-5lu %llu\n", BIT(i - 1), total.cmd_rtt[i]);
+
+	guard(mutex)(&ns2->lock);
+	seq_puts(s, "init_step_us:");
+	for (i = 0; i < NS2_INIT_DONE; i++)
+		seq_printf(s, " %u", ns2->init_step_us[i]);
+	seq_printf(s, "\ninit_us: %u\n", ns2->init_us);
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(switch2_stats);
 
-static int switch2_read_flash(struct switch2_controller *ns2, uint32_t address,
-	uint8_t size)
+static void switch2_debugfs_init(struct switch2_controller *ns2)
 {
-	uint8_t message[8] = { size, 0x7e };
+	ns2->debugfs = debugfs_create_dir(ns2->phys, switch2_debugfs_root);
+	debugfs_create_file("stats", 0444, ns2->debugfs, ns2, &switch2_stats_fops);
+}
 
-	if (!ns2->cfg)
-		return -ENOTCONN;
-	*(__le32 *)&message[4] = __cpu_to_le32(address);
-	return ns2->cfg->send_command(NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ, message,
-		sizeof(message), ns2->cfg);
+/*
+ * An optional read-only ring of raw input reports per controller, written
+ * straight from raw_event and mapped by userspace, for consumers that want
+ * every report without a syscall or copy per report.
+ */
+static unsigned int raw_ring;
+module_param(raw_ring, uint, 0444);
+MODULE_PARM_DESC(raw_ring,
+	"Entries in each controller's raw report ring, rounded up to a power of two (0 disables, default 0)");
+
+#define NS2_RAW_RING_MAX 65536
+
+struct switch2_raw_ring {
+	struct miscdevice misc;
+	struct kref ref;
+	char name[24];
+	int id;
+	void *buf;
+	struct switch2_raw_ring_header *header;
+	struct switch2_raw_entry *entries;
+	unsigned int mask;
+	u64 head;
+};
+
+static DEFINE_IDA(switch2_raw_ida);
+
+static void switch2_raw_release(struct kref *ref)
+{
+	struct switch2_raw_ring *ring = container_of(ref, struct switch2_raw_ring, ref);
+
+	vfree(ring->buf);
+	ida_free(&switch2_raw_ida, ring->id);
+	kfree(ring);
 }
 
-static int switch2_set_player_id(struct switch2_controller *ns2, uint32_t player_id)
+/* Called from raw_event with the RCU read lock held. There is only one writer. */
+static void switch2_raw_push(struct switch2_raw_ring *ring, uint8_t id,
+	const uint8_t *data, int size)
 {
-	player_id %= NS2_MAX_PLAYER_ID;
-	uint8_t message[8] = { switch2_player_pattern[player_id] };
+	struct switch2_raw_entry *entry = &ring->entries[ring->head & ring->mask];
+	u64 seq = ring->head;
 
-	if (!ns2->cfg)
-		return -ENOTCONN;
-	return ns2->cfg->send_command(NS2_CMD_LED, NS2_SUBCMD_LED_PATTERN,
-		&message, sizeof(message),
-		ns2->cfg);
+	WRITE_ONCE(entry->seq, U64_MAX);
+	smp_wmb();
+	entry->timestamp_ns = ktime_get_ns();
+	entry->report_id = id;
+	entry->size = min(size, NS2_RAW_REPORT_SIZE);
+	memcpy(entry->data, data, entry->size);
+	smp_store_release(&entry->seq, seq);
+
+	ring->head = seq + 1;
+	smp_store_release(&ring->header->head, ring->head);
 }
 
-static void switch2_config_buttons(struct input_dev *idev,
-		 const struct switch2_ctlr_button_mapping button_mappings[])
+static int switch2_raw_open(struct inode *inode, struct file *file)
 {
-	const struct switch2_ctlr_button_mapping *button;
+	struct switch2_raw_ring *ring = container_of(file->private_data,
+		struct switch2_raw_ring, misc);
 
-	for (button = button_mappings; button->code; button++)
-		input_set_capability(idev, EV_KEY, button->code);
+	/* misc_open() holds off misc_deregister(), so the ring is still alive */
+	kref_get(&ring->ref);
+	file->private_data = ring;
+	return 0;
 }
 
-static int switch2_init_input(struct switch2_controller *ns2)
+static int switch2_raw_release_file(struct inode *inode, struct file *file)
 {
-	struct input_dev *input;
-	struct hid_device *hdev = ns2->hdev;
-#ifdef CONFIG_SWITCH2_FF
-	int ret;
-#endif
+	struct switch2_raw_ring *ring = file->private_data;
 
-	rcu_read_lock();
-	input = rcu_dereference(ns2->input);
-	rcu_read_unlock();
+	kref_put(&ring->ref, switch2_raw_release);
+	return 0;
+}
 
-	if (input)
+static int switch2_raw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct switch2_raw_ring *ring = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, ring->buf, vma->vm_pgoff);
+}
+
+static const struct file_operations switch2_raw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= switch2_raw_open,
+	.release	= switch2_raw_release_file,
+	.mmap		= switch2_raw_mmap,
+};
+
+/* Must be called with the controller lock held, once ns2->hdev is set */
+static int switch2_raw_create(struct switch2_controller *ns2)
+{
+	unsigned int entries = READ_ONCE(raw_ring);
+	struct switch2_raw_ring *ring;
+	int ret;
+
+	if (!entries || rcu_access_pointer(ns2->raw))
 		return 0;
+	entries = roundup_pow_of_two(min(entries, NS2_RAW_RING_MAX));
 
-	input = devm_input_allocate_device(&hdev->dev);
-	if (!input)
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
 		return -ENOMEM;
+	kref_init(&ring->ref);
 
-	input_set_drvdata(input, ns2);
-	input->dev.parent = &hdev->dev;
-	input->id.bustype = hdev->bus;
-	input->id.vendor = hdev->vendor;
-	input->id.product = hdev->product;
-	input->id.version = hdev->version;
-	input->uniq = ns2->serial;
-	input->name = hdev->name;
-	input->phys = hdev->phys;
+	ring->buf = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(entries * sizeof(*ring->entries)));
+	if (!ring->buf) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	ring->header = ring->buf;
+	ring->header->version = NS2_RAW_RING_VERSION;
+	ring->header->entries = entries;
+	ring->header->entry_size = sizeof(*ring->entries);
+	ring->entries = ring->buf + PAGE_SIZE;
+	ring->mask = entries - 1;
 
-	switch (ns2->ctlr_type) {
-	case NS2_CTLR_TYPE_JCL:
-		input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
-		input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
-		switch2_config_buttons(input, left_joycon_button_mappings);
-		break;
-	case NS2_CTLR_TYPE_JCR:
-		input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		switch2_config_buttons(input, right_joycon_button_mappings);
-		break;
-	case NS2_CTLR_TYPE_GC:
-		input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+	ret = ida_alloc(&switch2_raw_ida, GFP_KERNEL);
+	if (ret < 0)
+		goto err_vfree;
+	ring->id = ret;
+	snprintf(ring->name, sizeof(ring->name), "switch2-raw%d", ring->id);
+
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.name = ring->name;
+	ring->misc.fops = &switch2_raw_fops;
+	ring->misc.parent = &ns2->hdev->dev;
+	ret = misc_register(&ring->misc);
+	if (ret) {
+		ida_free(&switch2_raw_ida, ring->id);
+		goto err_vfree;
+	}
+
+	rcu_assign_pointer(ns2->raw, ring);
+	return 0;
+
+err_vfree:
+	vfree(ring->buf);
+err_free:
+	kfree(ring);
+	return ret;
+}
+
+/* Must be called with the controller lock held */
+static void switch2_raw_destroy(struct switch2_controller *ns2)
+{
+	struct switch2_raw_ring *ring = rcu_replace_pointer(ns2->raw, NULL,
+		lockdep_is_held(&ns2->lock));
+
+	if (!ring)
+		return;
+
+	/* Wait for raw_event to finish with it; mappings keep their pages */
+	synchronize_rcu();
+	misc_deregister(&ring->misc);
+	kref_put(&ring->ref, switch2_raw_release);
+}
+
+/*
+ * With pair_joycons set, the first unpaired Joy-Con of each side share one
+ * extra input device. Each side publishes its decoded state into its own slot
+ * with a single atomic store, and whichever side takes pending from zero
+ * emits one frame with both halves, folding in whatever the other side
+ * publishes meanwhile, so neither side ever waits on the other.
+ */
+static bool pair_joycons;
+module_param(pair_joycons, bool, 0444);
+MODULE_PARM_DESC(pair_joycons,
+	"Merge each pair of left and right Joy-Cons into one more input device");
+
+struct switch2_pair_slot {
+	/* Buttons in the upper half, then the stick's x and y as s16 */
+	atomic64_t state;
+	const struct switch2_report_layout *layout;
+	/* Protected by switch2_pairs_lock */
+	struct switch2_controller *ns2;
+	/* Only touched by whoever is emitting */
+	uint32_t reported;
+};
+
+struct switch2_pair {
+	struct list_head node;
+	struct input_dev *input;
+	struct switch2_pair_slot side[2];
+	atomic_t pending;
+	int id;
+	char phys[24];
+};
+
+static LIST_HEAD(switch2_pairs);
+static DEFINE_MUTEX(switch2_pairs_lock);
+static DEFINE_IDA(switch2_pair_ida);
+
+VISIBLE_IF_KUNIT int switch2_config_input(struct input_dev *input, enum switch2_ctlr_type type);
+static void switch2_pair_publish(struct switch2_pair *pair, unsigned int side,
+	const struct switch2_report_layout *layout, uint64_t state);
+
+static struct switch2_pair *switch2_pair_create(void)
+{
+	struct switch2_pair *pair;
+	struct input_dev *input;
+	int ret;
+
+	pair = kzalloc(sizeof(*pair), GFP_KERNEL);
+	if (!pair)
+		return ERR_PTR(-ENOMEM);
+
+	ret = ida_alloc(&switch2_pair_ida, GFP_KERNEL);
+	if (ret < 0)
+		goto err_free;
+	pair->id = ret;
+	snprintf(pair->phys, sizeof(pair->phys), "switch2-pair%d", pair->id);
+
+	input = input_allocate_device();
+	if (!input) {
+		ret = -ENOMEM;
+		goto err_ida;
+	}
+	input->id.bustype = BUS_VIRTUAL;
+	input->id.vendor = USB_VENDOR_ID_NINTENDO;
+	input->name = "Nintendo Switch 2 Joy-Con Pair";
+	input->phys = pair->phys;
+	switch2_config_input(input, NS2_CTLR_TYPE_JCL);
+	switch2_config_input(input, NS2_CTLR_TYPE_JCR);
+
+	ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		goto err_ida;
+	}
+	pair->input = input;
+	return pair;
+
+err_ida:
+	ida_free(&switch2_pair_ida, pair->id);
+err_free:
+	kfree(pair);
+	return ERR_PTR(ret);
+}
+
+/* Must be called with the controller lock held */
+static int switch2_pair_join(struct switch2_controller *ns2)
+{
+	unsigned int side = ns2->ctlr_type == NS2_CTLR_TYPE_JCR;
+	struct switch2_pair *pair;
+
+	if (!pair_joycons || rcu_access_pointer(ns2->pair))
+		return 0;
+	if (ns2->ctlr_type != NS2_CTLR_TYPE_JCL && ns2->ctlr_type != NS2_CTLR_TYPE_JCR)
+		return 0;
+
+	guard(mutex)(&switch2_pairs_lock);
+	list_for_each_entry(pair, &switch2_pairs, node) {
+		if (!pair->side[side].ns2)
+			goto join;
+	}
+
+	pair = switch2_pair_create();
+	if (IS_ERR(pair))
+		return PTR_ERR(pair);
+	list_add_tail(&pair->node, &switch2_pairs);
+
+join:
+	pair->side[side].ns2 = ns2;
+	rcu_assign_pointer(ns2->pair, pair);
+	hid_info(ns2->hdev, "Joined %s\n", pair->phys);
+	return 0;
+}
+
+/* Must be called with the controller lock held */
+static void switch2_pair_leave(struct switch2_controller *ns2)
+{
+	struct switch2_pair *pair = rcu_replace_pointer(ns2->pair, NULL,
+		lockdep_is_held(&ns2->lock));
+	unsigned int side = ns2->ctlr_type == NS2_CTLR_TYPE_JCR;
+	struct switch2_pair_slot *slot;
+
+	if (!pair)
+		return;
+
+	/* After this, raw_event won't publish for this side anymore */
+	synchronize_rcu();
+
+	guard(mutex)(&switch2_pairs_lock);
+	slot = &pair->side[side];
+	slot->ns2 = NULL;
+	if (pair->side[!side].ns2) {
+		/* Release anything this side was holding and center its stick */
+		if (slot->layout)
+			switch2_pair_publish(pair, side, slot->layout, 0);
+		return;
+	}
+
+	list_del(&pair->node);
+	input_unregister_device(pair->input);
+	ida_free(&switch2_pair_ida, pair->id);
+	kfree(pair);
+}
+
+static struct switch2_controller *switch2_find_controller(struct hlist_bl_head *bucket,
+	const char *phys, u32 hash)
+{
+	struct switch2_controller *ns2;
+	struct hlist_bl_node *pos;
+
+	hlist_bl_for_each_entry_rcu(ns2, pos, bucket, node) {
+		if (ns2->phys_hash == hash && strncmp(ns2->phys, phys, NS2_PHYS_MAX) == 0 &&
+		    kref_get_unless_zero(&ns2->ref))
+			return ns2;
+	}
+	return NULL;
+}
+
+static void switch2_init_work(struct work_struct *work);
+static void switch2_fw_work(struct work_struct *work);
+static void switch2_fw_free(struct switch2_fw_update *fwu);
+static void switch2_flash_free_cache(struct switch2_flash_cache *cache);
+
+/* Allocate a controller that isn't yet visible to anyone else */
+static struct switch2_controller *switch2_alloc_controller(const char *phys)
+{
+	struct switch2_controller *ns2;
+	size_t i;
+	int ret;
+
+	ns2 = kmem_cache_zalloc(switch2_controller_cache, GFP_KERNEL);
+	if (!ns2)
+		return ERR_PTR(-ENOMEM);
+
+	ns2->phys = kstrndup(phys, NS2_PHYS_MAX - 1, GFP_KERNEL);
+	ns2->stats = alloc_percpu(struct switch2_stats);
+	if (!ns2->phys || !ns2->stats) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	mutex_init(&ns2->lock);
+	mutex_init(&ns2->features_lock);
+	kref_init(&ns2->ref);
+	INIT_LIST_HEAD(&ns2->cmd_pending);
+	spin_lock_init(&ns2->cmd_lock);
+	INIT_DELAYED_WORK(&ns2->cmd_timeout_work, switch2_cmd_timeout_work);
+	INIT_WORK(&ns2->init_work, switch2_init_work);
+	INIT_WORK(&ns2->fw_work, switch2_fw_work);
+	for (i = 0; i < ARRAY_SIZE(ns2->init_requests); i++) {
+		INIT_LIST_HEAD(&ns2->init_requests[i].entry);
+		init_completion(&ns2->init_requests[i].done);
+	}
+	switch2_prepare_stick_calibration(&ns2->stick_calib[0]);
+	switch2_prepare_stick_calibration(&ns2->stick_calib[1]);
+	scoped_guard(mutex, &ns2->lock)
+		ret = switch2_publish_calibration(ns2);
+	if (ret) {
+		mutex_destroy(&ns2->features_lock);
+		mutex_destroy(&ns2->lock);
+		goto err_free;
+	}
+	ns2->features = switch2_default_features();
+	return ns2;
+
+err_free:
+	free_percpu(ns2->stats);
+	kfree(ns2->phys);
+	kmem_cache_free(switch2_controller_cache, ns2);
+	return ERR_PTR(ret);
+}
+
+static void switch2_controller_free_rcu(struct rcu_head *rcu)
+{
+	struct switch2_controller *ns2 = container_of(rcu, struct switch2_controller, rcu);
+
+	/* Lookups compare phys under RCU, so it goes with the controller */
+	kfree(ns2->phys);
+	kmem_cache_free(switch2_controller_cache, ns2);
+}
+
+/* Free a controller from switch2_alloc_controller() that was never published */
+static void switch2_free_controller(struct switch2_controller *ns2)
+{
+	cancel_work_sync(&ns2->init_work);
+	cancel_work_sync(&ns2->fw_work);
+	cancel_delayed_work_sync(&ns2->cmd_timeout_work);
+	mutex_destroy(&ns2->features_lock);
+	mutex_destroy(&ns2->lock);
+	kfree(rcu_access_pointer(ns2->calib));
+	free_percpu(ns2->stats);
+	kfree(ns2->phys);
+	kmem_cache_free(switch2_controller_cache, ns2);
+}
+
+struct switch2_controller *switch2_get_controller(const char *phys)
+{
+	u32 hash = jhash(phys, strnlen(phys, NS2_PHYS_MAX - 1), 0);
+	struct hlist_bl_head *bucket =
+		&switch2_controllers[hash_32(hash, NS2_CONTROLLER_HASH_BITS)];
+	struct switch2_controller *ns2, *found;
+
+	rcu_read_lock();
+	ns2 = switch2_find_controller(bucket, phys, hash);
+	rcu_read_unlock();
+	if (ns2)
+		return ns2;
+
+	ns2 = switch2_alloc_controller(phys);
+	if (IS_ERR(ns2))
+		return ns2;
+	ns2->phys_hash = hash;
+
+	/* The other interface of the same controller may have raced us here */
+	hlist_bl_lock(bucket);
+	found = switch2_find_controller(bucket, phys, hash);
+	if (!found)
+		hlist_bl_add_head_rcu(&ns2->node, bucket);
+	hlist_bl_unlock(bucket);
+
+	if (found) {
+		switch2_free_controller(ns2);
+		return found;
+	}
+
+	switch2_debugfs_init(ns2);
+	return ns2;
+}
+EXPORT_SYMBOL_GPL(switch2_get_controller);
+
+static void switch2_controller_release(struct kref *ref)
+{
+	struct switch2_controller *ns2 = container_of(ref, struct switch2_controller, ref);
+	struct hlist_bl_head *bucket =
+		&switch2_controllers[hash_32(ns2->phys_hash, NS2_CONTROLLER_HASH_BITS)];
+
+	hlist_bl_lock(bucket);
+	hlist_bl_del_rcu(&ns2->node);
+	hlist_bl_unlock(bucket);
+
+	debugfs_remove_recursive(ns2->debugfs);
+	cancel_work_sync(&ns2->init_work);
+	cancel_work_sync(&ns2->fw_work);
+	switch2_fw_free(ns2->fw_update);
+	switch2_flash_free_cache(ns2->flash_cache);
+	cancel_delayed_work_sync(&ns2->cmd_timeout_work);
+	free_percpu(ns2->stats);
+	mutex_destroy(&ns2->features_lock);
+	mutex_destroy(&ns2->lock);
+	kfree_rcu(rcu_dereference_protected(ns2->calib, true), rcu);
+	call_rcu(&ns2->rcu, switch2_controller_free_rcu);
+}
+
+/* Each interface holds a reference from switch2_get_controller() until this */
+void switch2_controller_put(struct switch2_controller *ns2)
+{
+	struct input_dev *input, *imu, *mouse;
+
+	mutex_lock(&ns2->lock);
+	switch2_raw_destroy(ns2);
+	switch2_pair_leave(ns2);
+	/* The report path may still be using these, let it finish before they go */
+	input = rcu_replace_pointer(ns2->input, NULL, lockdep_is_held(&ns2->lock));
+	imu = rcu_replace_pointer(ns2->imu, NULL, lockdep_is_held(&ns2->lock));
+	mouse = rcu_replace_pointer(ns2->mouse, NULL, lockdep_is_held(&ns2->lock));
+	if (input || imu || mouse)
+		synchronize_rcu();
+	if (input) {
+		input_unregister_device(input);
+#ifdef CONFIG_SWITCH2_FF
+		switch2_ff_free_effects(ns2);
+#endif
+	}
+	if (imu)
+		input_unregister_device(imu);
+	if (mouse)
+		input_unregister_device(mouse);
+	switch2_cmd_cancel_all(ns2);
+	ns2->init_sent = 0;
+	ns2->init_done = 0;
+	ns2->init_inflight = 0;
+	/* An interface that comes back is probed afresh, not resumed */
+	WRITE_ONCE(ns2->suspended, 0);
+	mutex_unlock(&ns2->lock);
+
+	kref_put(&ns2->ref, switch2_controller_release);
+}
+EXPORT_SYMBOL_GPL(switch2_controller_put);
+
+/*
+ * Calibration doesn't change while a controller is unplugged, so remember it by
+ * serial number and firmware version. A controller that comes back only needs
+ * those two read before it is ready for input again, and one that was updated
+ * or reflashed elsewhere in the meantime no longer matches its old entry.
+ */
+struct switch2_calib_cache_entry {
+	struct list_head entry;
+	char serial[NS2_FLASH_SIZE_SERIAL + 1];
+	struct switch2_version_info version;
+	struct switch2_stick_calibration stick_calib[2];
+	uint8_t lt_zero;
+	uint8_t rt_zero;
+};
+
+static DEFINE_MUTEX(switch2_calib_cache_lock);
+static LIST_HEAD(switch2_calib_cache);
+static unsigned int switch2_calib_cache_count;
+static unsigned int calib_cache_size = 16;
+
+/* Must be called with switch2_calib_cache_lock held */
+static void switch2_calib_cache_trim(unsigned int size)
+{
+	struct switch2_calib_cache_entry *entry;
+
+	while (switch2_calib_cache_count > size) {
+		entry = list_last_entry(&switch2_calib_cache,
+			struct switch2_calib_cache_entry, entry);
+		list_del(&entry->entry);
+		switch2_calib_cache_count--;
+		kfree(entry);
+	}
+}
+
+/* Must be called with switch2_calib_cache_lock held */
+static struct switch2_calib_cache_entry *switch2_calib_cache_find(const char *serial)
+{
+	struct switch2_calib_cache_entry *entry;
+
+	list_for_each_entry(entry, &switch2_calib_cache, entry) {
+		if (memcmp(entry->serial, serial, sizeof(entry->serial)) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static bool switch2_calib_cache_match(const struct switch2_calib_cache_entry *entry,
+	const struct switch2_version_info *version)
+{
+	return memcmp(&entry->version, version, sizeof(entry->version)) == 0;
+}
+
+static void switch2_calib_cache_store(struct switch2_controller *ns2)
+{
+	struct switch2_calib_cache_entry *entry;
+
+	if (!ns2->serial[0])
+		return;
+
+	guard(mutex)(&switch2_calib_cache_lock);
+	if (!calib_cache_size)
+		return;
+
+	entry = switch2_calib_cache_find(ns2->serial);
+	if (entry) {
+		list_del(&entry->entry);
+	} else {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry)
+			return;
+		memcpy(entry->serial, ns2->serial, sizeof(entry->serial));
+		switch2_calib_cache_count++;
+	}
+
+	entry->version = ns2->version;
+	memcpy(entry->stick_calib, ns2->stick_calib, sizeof(entry->stick_calib));
+	entry->lt_zero = ns2->lt_zero;
+	entry->rt_zero = ns2->rt_zero;
+	list_add(&entry->entry, &switch2_calib_cache);
+	switch2_calib_cache_trim(calib_cache_size);
+}
+
+static bool switch2_calib_cache_restore(struct switch2_controller *ns2)
+{
+	struct switch2_calib_cache_entry *entry;
+
+	if (!ns2->serial[0])
+		return false;
+
+	guard(mutex)(&switch2_calib_cache_lock);
+	entry = switch2_calib_cache_find(ns2->serial);
+	if (!entry)
+		return false;
+	/* Storing again once init is done replaces the stale entry */
+	if (!switch2_calib_cache_match(entry, &ns2->version))
+		return false;
+
+	list_move(&entry->entry, &switch2_calib_cache);
+	memcpy(ns2->stick_calib, entry->stick_calib, sizeof(ns2->stick_calib));
+	ns2->lt_zero = entry->lt_zero;
+	ns2->rt_zero = entry->rt_zero;
+	return true;
+}
+
+/* Forget @serial, e.g. once its flash has been rewritten */
+static void switch2_calib_cache_forget(const char *serial)
+{
+	struct switch2_calib_cache_entry *entry;
+
+	if (!serial[0])
+		return;
+
+	guard(mutex)(&switch2_calib_cache_lock);
+	entry = switch2_calib_cache_find(serial);
+	if (!entry)
+		return;
+	list_del(&entry->entry);
+	switch2_calib_cache_count--;
+	kfree(entry);
+}
+
+static int switch2_calib_cache_size_set(const char *val, const struct kernel_param *kp)
+{
+	int ret;
+
+	guard(mutex)(&switch2_calib_cache_lock);
+	ret = param_set_uint(val, kp);
+	if (ret)
+		return ret;
+	switch2_calib_cache_trim(calib_cache_size);
+	return 0;
+}
+
+static const struct kernel_param_ops switch2_calib_cache_size_ops = {
+	.set = switch2_calib_cache_size_set,
+	.get = param_get_uint,
+};
+module_param_cb(calib_cache_size, &switch2_calib_cache_size_ops, &calib_cache_size, 0644);
+MODULE_PARM_DESC(calib_cache_size,
+	"Number of controllers whose calibration is remembered across reconnects (0 disables)");
+
+static int switch2_calib_cache_flush_set(const char *val, const struct kernel_param *kp)
+{
+	guard(mutex)(&switch2_calib_cache_lock);
+	switch2_calib_cache_trim(0);
+	return 0;
+}
+
+static const struct kernel_param_ops switch2_calib_cache_flush_ops = {
+	.set = switch2_calib_cache_flush_set,
+};
+module_param_cb(calib_cache_flush, &switch2_calib_cache_flush_ops, NULL, 0200);
+MODULE_PARM_DESC(calib_cache_flush,
+	"Write anything to forget all cached calibration, e.g. after recalibrating a stick");
+
+VISIBLE_IF_KUNIT bool switch2_parse_stick_calibration(struct switch2_stick_calibration *calib,
+	const uint8_t *data)
+{
+	static const uint8_t UNCALIBRATED[9] = {
+		0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+	};
+	if (memcmp(UNCALIBRATED, data, sizeof(UNCALIBRATED)) == 0)
+		return false;
+
+	calib->x.neutral = data[0];
+	calib->x.neutral |= (data[1] & 0x0F) << 8;
+
+	calib->y.neutral = data[1] >> 4;
+	calib->y.neutral |= data[2] << 4;
+
+	calib->x.positive = data[3];
+	calib->x.positive |= (data[4] & 0x0F) << 8;
+
+	calib->y.positive = data[4] >> 4;
+	calib->y.positive |= data[5] << 4;
+
+	calib->x.negative = data[6];
+	calib->x.negative |= (data[7] & 0x0F) << 8;
+
+	calib->y.negative = data[7] >> 4;
+	calib->y.negative |= data[8] << 4;
+
+	switch2_prepare_stick_calibration(calib);
+	return true;
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_parse_stick_calibration);
+
+static void switch2_handle_flash_read(struct switch2_controller *ns2, uint8_t size,
+	uint32_t address, const uint8_t *data)
+{
+	bool ok;
+
+	switch (address) {
+	case NS2_FLASH_ADDR_SERIAL:
+		if (size != NS2_FLASH_SIZE_SERIAL)
+			return;
+		memcpy(ns2->serial, data, size);
+		break;
+	case NS2_FLASH_ADDR_FACTORY_PRIMARY_CALIB:
+		if (size != NS2_FLASH_SIZE_FACTORY_AXIS_CALIB)
+			return;
+		ok = switch2_parse_stick_calibration(&ns2->stick_calib[0], data);
+		if (ok) {
+			switch2_dbg(ns2, "Got factory primary stick calibration:\n");
+			switch2_dbg(ns2, "Left max: %i, neutral: %i, right max: %i\n",
+				ns2->stick_calib[0].x.negative,
+				ns2->stick_calib[0].x.neutral,
+				ns2->stick_calib[0].x.positive);
+			switch2_dbg(ns2, "Down max: %i, neutral: %i, up max: %i\n",
+				ns2->stick_calib[0].y.negative,
+				ns2->stick_calib[0].y.neutral,
+				ns2->stick_calib[0].y.positive);
+		} else {
+			switch2_dbg(ns2, "Factory primary stick calibration not present\n");
+		}
+		break;
+	case NS2_FLASH_ADDR_FACTORY_SECONDARY_CALIB:
+		if (size != NS2_FLASH_SIZE_FACTORY_AXIS_CALIB)
+			return;
+		ok = switch2_parse_stick_calibration(&ns2->stick_calib[1], data);
+		if (ok) {
+			switch2_dbg(ns2, "Got factory secondary stick calibration:\n");
+			switch2_dbg(ns2, "Left max: %i, neutral: %i, right max: %i\n",
+				ns2->stick_calib[1].x.negative,
+				ns2->stick_calib[1].x.neutral,
+				ns2->stick_calib[1].x.positive);
+			switch2_dbg(ns2, "Down max: %i, neutral: %i, up max: %i\n",
+				ns2->stick_calib[1].y.negative,
+				ns2->stick_calib[1].y.neutral,
+				ns2->stick_calib[1].y.positive);
+		} else {
+			switch2_dbg(ns2, "Factory secondary stick calibration not present\n");
+		}
+		break;
+	case NS2_FLASH_ADDR_FACTORY_TRIGGER_CALIB:
+		if (size != NS2_FLASH_SIZE_FACTORY_TRIGGER_CALIB)
+			return;
+		if (data[0] != 0xFF && data[1] != 0xFF) {
+			ns2->lt_zero = data[0];
+			ns2->rt_zero = data[1];
+
+			switch2_dbg(ns2, "Got factory trigger calibration:\n");
+			switch2_dbg(ns2, "Left zero point: %i\n", ns2->lt_zero);
+			switch2_dbg(ns2, "Right zero point: %i\n", ns2->rt_zero);
+		} else {
+			switch2_dbg(ns2, "Factory trigger calibration not present\n");
+		}
+		break;
+	case NS2_FLASH_ADDR_USER_PRIMARY_CALIB:
+		if (size != NS2_FLASH_SIZE_USER_AXIS_CALIB)
+			return;
+		if (__le16_to_cpu(*(__le16 *)data) != NS2_USER_CALIB_MAGIC) {
+			switch2_dbg(ns2, "No user primary stick calibration present\n");
+			break;
+		}
+
+		ok = switch2_parse_stick_calibration(&ns2->stick_calib[0], &data[2]);
+		if (ok) {
+			switch2_dbg(ns2, "Got user primary stick calibration:\n");
+			switch2_dbg(ns2, "Left max: %i, neutral: %i, right max: %i\n",
+				ns2->stick_calib[0].x.negative,
+				ns2->stick_calib[0].x.neutral,
+				ns2->stick_calib[0].x.positive);
+			switch2_dbg(ns2, "Down max: %i, neutral: %i, up max: %i\n",
+				ns2->stick_calib[0].y.negative,
+				ns2->stick_calib[0].y.neutral,
+				ns2->stick_calib[0].y.positive);
+		} else {
+			switch2_dbg(ns2, "No user primary stick calibration present\n");
+		}
+		break;
+	case NS2_FLASH_ADDR_USER_SECONDARY_CALIB:
+		if (size != NS2_FLASH_SIZE_USER_AXIS_CALIB)
+			return;
+		if (__le16_to_cpu(*(__le16 *)data) != NS2_USER_CALIB_MAGIC) {
+			switch2_dbg(ns2, "No user secondary stick calibration present\n");
+			break;
+		}
+
+		ok = switch2_parse_stick_calibration(&ns2->stick_calib[1], &data[2]);
+		if (ok) {
+			switch2_dbg(ns2, "Got user secondary stick calibration:\n");
+			switch2_dbg(ns2, "Left max: %i, neutral: %i, right max: %i\n",
+				ns2->stick_calib[1].x.negative,
+				ns2->stick_calib[1].x.neutral,
+				ns2->stick_calib[1].x.positive);
+			switch2_dbg(ns2, "Down max: %i, neutral: %i, up max: %i\n",
+				ns2->stick_calib[1].y.negative,
+				ns2->stick_calib[1].y.neutral,
+				ns2->stick_calib[1].y.positive);
+		} else {
+			switch2_dbg(ns2, "No user secondary stick calibration present\n");
+		}
+		break;
+	}
+}
+
+/* @subcommand is one of NS2_SUBCMD_FEATSEL_SET_MASK, _ENABLE or _DISABLE */
+static int switch2_features_cmd(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, uint8_t subcommand, uint32_t features)
+{
+	__le32 feature_bits = __cpu_to_le32(features);
+
+	return switch2_cmd_send(ns2, req, NS2_CMD_FEATSEL, subcommand,
+		&feature_bits, sizeof(feature_bits));
+}
+
+static int switch2_read_flash(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, uint32_t address, uint8_t size)
+{
+	uint8_t message[8] = { size, 0x7e };
+
+	*(__le32 *)&message[4] = __cpu_to_le32(address);
+	return switch2_cmd_send(ns2, req, NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ, message,
+		sizeof(message));
+}
+
+static int switch2_set_player_id(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, uint32_t player_id)
+{
+	player_id %= ARRAY_SIZE(switch2_player_pattern);
+	uint8_t message[8] = { switch2_player_pattern[player_id] };
+
+	return switch2_cmd_send(ns2, req, NS2_CMD_LED, NS2_SUBCMD_LED_PATTERN,
+		&message, sizeof(message));
+}
+
+static void switch2_config_buttons(struct input_dev *idev,
+		 const struct switch2_ctlr_button_mapping button_mappings[], size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		input_set_capability(idev, EV_KEY, button_mappings[i].code);
+}
+
+static int switch2_init_imu(struct switch2_controller *ns2)
+{
+	struct hid_device *hdev = ns2->hdev;
+	struct input_dev *input;
+	int ret;
+
+	input = devm_input_allocate_device(&hdev->dev);
+	if (!input)
+		return -ENOMEM;
+
+	input_set_drvdata(input, ns2);
+	input->dev.parent = &hdev->dev;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->uniq = ns2->serial;
+	input->name = devm_kasprintf(&hdev->dev, GFP_KERNEL, "%s (IMU)", hdev->name);
+	if (!input->name)
+		return -ENOMEM;
+	input->phys = hdev->phys;
+
+	__set_bit(INPUT_PROP_ACCELEROMETER, input->propbit);
+	input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 0, 0);
+	input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 0, 0);
+	input_set_abs_params(input, ABS_Z, NS2_AXIS_MIN, NS2_AXIS_MAX, 0, 0);
+	input_abs_set_res(input, ABS_X, NS2_IMU_ACCEL_RES_PER_G);
+	input_abs_set_res(input, ABS_Y, NS2_IMU_ACCEL_RES_PER_G);
+	input_abs_set_res(input, ABS_Z, NS2_IMU_ACCEL_RES_PER_G);
+	input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 0, 0);
+	input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 0, 0);
+	input_set_abs_params(input, ABS_RZ, NS2_AXIS_MIN, NS2_AXIS_MAX, 0, 0);
+	input_abs_set_res(input, ABS_RX, NS2_IMU_GYRO_RES_PER_DPS);
+	input_abs_set_res(input, ABS_RY, NS2_IMU_GYRO_RES_PER_DPS);
+	input_abs_set_res(input, ABS_RZ, NS2_IMU_GYRO_RES_PER_DPS);
+	input_set_capability(input, EV_MSC, MSC_TIMESTAMP);
+
+	ret = input_register_device(input);
+	if (ret)
+		return ret;
+
+	rcu_assign_pointer(ns2->imu, input);
+	return 0;
+}
+
+/* Only Joy-Cons have the optical sensor; for anything else this does nothing */
+static int switch2_init_mouse(struct switch2_controller *ns2)
+{
+	struct hid_device *hdev = ns2->hdev;
+	const struct switch2_report_layout *layout;
+	struct input_dev *input;
+	int ret;
+
+	if (!switch2_ctlr_is_joycon(ns2->ctlr_type))
+		return 0;
+	layout = &switch2_unified_layouts[ns2->ctlr_type];
+
+	input = devm_input_allocate_device(&hdev->dev);
+	if (!input)
+		return -ENOMEM;
+
+	input_set_drvdata(input, ns2);
+	input->dev.parent = &hdev->dev;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->uniq = ns2->serial;
+	input->name = devm_kasprintf(&hdev->dev, GFP_KERNEL, "%s (Mouse)", hdev->name);
+	if (!input->name)
+		return -ENOMEM;
+	input->phys = hdev->phys;
+
+	__set_bit(INPUT_PROP_POINTER, input->propbit);
+	input_set_capability(input, EV_REL, REL_X);
+	input_set_capability(input, EV_REL, REL_Y);
+	input_set_capability(input, EV_REL, REL_WHEEL);
+	input_set_capability(input, EV_REL, REL_HWHEEL);
+	input_set_capability(input, EV_REL, REL_WHEEL_HI_RES);
+	input_set_capability(input, EV_REL, REL_HWHEEL_HI_RES);
+	switch2_config_buttons(input, layout->mouse_mappings, layout->mouse_mapping_count);
+
+	ret = input_register_device(input);
+	if (ret)
+		return ret;
+
+	ns2->mouse_synced = false;
+	rcu_assign_pointer(ns2->mouse, input);
+	return 0;
+}
+
+/* Set up the axes and buttons of @type, shared by the real device and the KUnit suite */
+VISIBLE_IF_KUNIT int switch2_config_input(struct input_dev *input, enum switch2_ctlr_type type)
+{
+	switch (type) {
+	case NS2_CTLR_TYPE_JCL:
+		input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+		input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+		switch2_config_buttons(input, left_joycon_button_mappings,
+			ARRAY_SIZE(left_joycon_button_mappings));
+		break;
+	case NS2_CTLR_TYPE_JCR:
+		input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		switch2_config_buttons(input, right_joycon_button_mappings,
+			ARRAY_SIZE(right_joycon_button_mappings));
+		break;
+	case NS2_CTLR_TYPE_GC:
+		input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
 		input_set_abs_params(input, ABS_Z, 0, NS2_TRIGGER_RANGE, 32, 128);
 		input_set_abs_params(input, ABS_RZ, 0, NS2_TRIGGER_RANGE, 32, 128);
 		input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
 		input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
-		switch2_config_buttons(input, gccon_mappings);
+		switch2_config_buttons(input, gccon_mappings,
+			ARRAY_SIZE(gccon_mappings));
+		break;
+	case NS2_CTLR_TYPE_PRO:
+		input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
+		input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+		input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+		switch2_config_buttons(input, procon_mappings,
+			ARRAY_SIZE(procon_mappings));
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_config_input);
+
+static int switch2_init_input(struct switch2_controller *ns2)
+{
+	struct input_dev *input;
+	struct hid_device *hdev = ns2->hdev;
+	int ret;
+
+	rcu_read_lock();
+	input = rcu_dereference(ns2->input);
+	rcu_read_unlock();
+
+	if (input)
+		return 0;
+
+	input = devm_input_allocate_device(&hdev->dev);
+	if (!input)
+		return -ENOMEM;
+
+	/* A new device starts with every button released */
+	ns2->last_buttons = 0;
+	ns2->last_calib_gen = 0;
+
+	input_set_drvdata(input, ns2);
+	input->dev.parent = &hdev->dev;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->uniq = ns2->serial;
+	input->name = hdev->name;
+	input->phys = hdev->phys;
+
+	ret = switch2_pair_join(ns2);
+	if (ret)
+		hid_warn(hdev, "Failed to join a Joy-Con pair: %d\n", ret);
+
+	/*
+	 * A paired Joy-Con's buttons and stick come out of the pair device, so its
+	 * own only keeps rumble instead of posing as a gamepad that never moves.
+	 */
+	if (!rcu_access_pointer(ns2->pair)) {
+		ret = switch2_config_input(input, ns2->ctlr_type);
+		if (ret) {
+			input_free_device(input);
+			return ret;
+		}
+	}
+
+#ifdef CONFIG_SWITCH2_FF
+	input_set_capability(input, EV_FF, FF_RUMBLE);
+	if (ns2->ctlr_type != NS2_CTLR_TYPE_GC) {
+		input_set_capability(input, EV_FF, FF_PERIODIC);
+		input_set_capability(input, EV_FF, FF_CUSTOM);
+	}
+	ret = input_ff_create(input, NS2_FF_EFFECTS);
+	if (ret) {
+		input_free_device(input);
+		return ret;
+	}
+	input->ff->upload = switch2_ff_upload;
+	input->ff->erase = switch2_ff_erase;
+	input->ff->playback = switch2_ff_playback;
+#endif
+
+	rcu_assign_pointer(ns2->input, input);
+
+	if (ns2->features & NS2_FEATURE_IMU) {
+		ret = switch2_init_imu(ns2);
+		if (ret)
+			hid_warn(hdev, "Failed to create IMU device: %d\n", ret);
+	}
+
+	if (ns2->features & NS2_FEATURE_MOUSE) {
+		ret = switch2_init_mouse(ns2);
+		if (ret)
+			hid_warn(hdev, "Failed to create mouse device: %d\n", ret);
+	}
+
+	ret = switch2_raw_create(ns2);
+	if (ret)
+		hid_warn(hdev, "Failed to create raw report ring: %d\n", ret);
+
+	hid_info(ns2->hdev, "Firmware version %u.%u.%u (%i)\n", ns2->version.major,
+		ns2->version.minor, ns2->version.patch, ns2->version.ctlr_type);
+	if (ns2->version.dsp_type >= 0)
+		hid_info(ns2->hdev, "DSP version %u.%u.%u\n", ns2->version.dsp_major,
+			ns2->version.dsp_minor, ns2->version.dsp_patch);
+	return input_register_device(input);
+}
+
+/*
+ * Init steps are not strictly ordered: each one only waits on the steps whose
+ * results it needs, so independent commands can be in flight at the same time.
+ * The firmware info must arrive first as it tells us which controller type we
+ * are talking to, and user calibration must be applied after the factory
+ * calibration it overrides. The firmware info itself waits on the serial, and
+ * the two together find a controller we have seen before in the calibration
+ * cache so that it can skip the flash reads.
+ */
+struct switch2_init_desc {
+	uint8_t command;
+	uint8_t subcommand;
+	uint8_t size;
+	uint32_t address;
+	unsigned long depends;
+};
+
+#define NS2_INIT_BIT(step) BIT(NS2_INIT_##step)
+#ifdef CONFIG_SWITCH2_FF
+#define NS2_INIT_RUMBLE_BIT NS2_INIT_BIT(ENABLE_RUMBLE)
+#else
+#define NS2_INIT_RUMBLE_BIT 0
+#endif
+
+/* Steps whose results are kept in the calibration cache */
+#define NS2_INIT_CACHED_STEPS (NS2_INIT_BIT(READ_FACTORY_PRIMARY_CALIB) | \
+	NS2_INIT_BIT(READ_FACTORY_SECONDARY_CALIB) | \
+	NS2_INIT_BIT(READ_FACTORY_TRIGGER_CALIB) | \
+	NS2_INIT_BIT(READ_USER_PRIMARY_CALIB) | \
+	NS2_INIT_BIT(READ_USER_SECONDARY_CALIB))
+
+/*
+ * Steps that put the controller into the state we run it in, rather than read
+ * something from it. The controller forgets these over a suspend, so they are
+ * all that resume has to send again.
+ */
+#define NS2_INIT_STATE_STEPS (NS2_INIT_BIT(SET_FEATURE_MASK) | \
+	NS2_INIT_BIT(ENABLE_FEATURES) | \
+	NS2_INIT_RUMBLE_BIT | \
+	NS2_INIT_BIT(GRIP_BUTTONS) | \
+	NS2_INIT_BIT(SET_PLAYER_LEDS) | \
+	NS2_INIT_BIT(SELECT_REPORT) | \
+	NS2_INIT_BIT(INPUT) | \
+	NS2_INIT_BIT(DONE))
+
+static const struct switch2_init_desc switch2_init_steps[NS2_INIT_DONE + 1] = {
+	[NS2_INIT_READ_SERIAL] = {
+		NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ,
+		NS2_FLASH_SIZE_SERIAL, NS2_FLASH_ADDR_SERIAL,
+	},
+	[NS2_INIT_READ_FACTORY_PRIMARY_CALIB] = {
+		NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ,
+		NS2_FLASH_SIZE_FACTORY_AXIS_CALIB, NS2_FLASH_ADDR_FACTORY_PRIMARY_CALIB,
+		NS2_INIT_BIT(GET_FIRMWARE_INFO),
+	},
+	[NS2_INIT_READ_FACTORY_SECONDARY_CALIB] = {
+		NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ,
+		NS2_FLASH_SIZE_FACTORY_AXIS_CALIB, NS2_FLASH_ADDR_FACTORY_SECONDARY_CALIB,
+		NS2_INIT_BIT(GET_FIRMWARE_INFO),
+	},
+	[NS2_INIT_READ_FACTORY_TRIGGER_CALIB] = {
+		NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ,
+		NS2_FLASH_SIZE_FACTORY_TRIGGER_CALIB, NS2_FLASH_ADDR_FACTORY_TRIGGER_CALIB,
+		NS2_INIT_BIT(GET_FIRMWARE_INFO),
+	},
+	[NS2_INIT_READ_USER_PRIMARY_CALIB] = {
+		NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ,
+		NS2_FLASH_SIZE_USER_AXIS_CALIB, NS2_FLASH_ADDR_USER_PRIMARY_CALIB,
+		NS2_INIT_BIT(READ_FACTORY_PRIMARY_CALIB),
+	},
+	[NS2_INIT_READ_USER_SECONDARY_CALIB] = {
+		NS2_CMD_FLASH, NS2_SUBCMD_FLASH_READ,
+		NS2_FLASH_SIZE_USER_AXIS_CALIB, NS2_FLASH_ADDR_USER_SECONDARY_CALIB,
+		NS2_INIT_BIT(READ_FACTORY_SECONDARY_CALIB),
+	},
+	[NS2_INIT_SET_FEATURE_MASK] = {
+		NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_SET_MASK,
+	},
+	[NS2_INIT_ENABLE_FEATURES] = {
+		NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_ENABLE,
+		.depends = NS2_INIT_BIT(SET_FEATURE_MASK),
+	},
+	[NS2_INIT_GET_FIRMWARE_INFO] = {
+		NS2_CMD_FW_INFO, NS2_SUBCMD_FW_INFO_GET,
+		.depends = NS2_INIT_BIT(READ_SERIAL),
+	},
+#ifdef CONFIG_SWITCH2_FF
+	[NS2_INIT_ENABLE_RUMBLE] = {
+		NS2_CMD_NFC, 1,
+		.depends = NS2_INIT_BIT(ENABLE_FEATURES),
+	},
+#endif
+	[NS2_INIT_GRIP_BUTTONS] = {
+		NS2_CMD_GRIP, NS2_SUBCMD_GRIP_ENABLE_BUTTONS,
+		.depends = NS2_INIT_BIT(GET_FIRMWARE_INFO),
+	},
+	[NS2_INIT_SET_PLAYER_LEDS] = {
+		NS2_CMD_LED, NS2_SUBCMD_LED_PATTERN,
+	},
+	[NS2_INIT_SELECT_REPORT] = {
+		NS2_CMD_INIT, NS2_SUBCMD_INIT_SELECT_REPORT,
+	},
+	[NS2_INIT_INPUT] = {
+		NS2_CMD_INIT, NS2_SUBCMD_INIT_USB,
+		.depends = NS2_INIT_BIT(ENABLE_FEATURES) | NS2_INIT_RUMBLE_BIT |
+			NS2_INIT_BIT(GRIP_BUTTONS) | NS2_INIT_BIT(SELECT_REPORT),
+	},
+	[NS2_INIT_DONE] = {
+		.depends = GENMASK(NS2_INIT_DONE - 1, NS2_INIT_READ_SERIAL),
+	},
+};
+
+static bool switch2_init_step_needed(struct switch2_controller *ns2,
+	enum switch2_init_step step)
+{
+	switch (step) {
+	case NS2_INIT_READ_FACTORY_SECONDARY_CALIB:
+	case NS2_INIT_READ_USER_SECONDARY_CALIB:
+		return !switch2_ctlr_is_joycon(ns2->ctlr_type);
+	case NS2_INIT_READ_FACTORY_TRIGGER_CALIB:
+		return ns2->ctlr_type == NS2_CTLR_TYPE_GC;
+	case NS2_INIT_GRIP_BUTTONS:
+		return switch2_ctlr_is_joycon(ns2->ctlr_type);
+	case NS2_INIT_SELECT_REPORT:
+		return unified_report || (ns2->features & NS2_FEATURES_UNIFIED);
+	default:
+		return true;
+	}
+}
+
+static bool switch2_init_step_ready(struct switch2_controller *ns2,
+	enum switch2_init_step step)
+{
+	unsigned long depends = switch2_init_steps[step].depends;
+
+	return !(ns2->init_sent & BIT(step)) && (ns2->init_done & depends) == depends;
+}
+
+/*
+ * Merge every other flash read that is ready to go and fits in the same reply
+ * as @step into a single read. Returns the steps covered by that read.
+ */
+VISIBLE_IF_KUNIT unsigned long switch2_init_plan_flash_read(struct switch2_controller *ns2,
+	enum switch2_init_step step, uint32_t *address, uint8_t *size)
+{
+	const struct switch2_init_desc *desc = &switch2_init_steps[step];
+	uint32_t start = desc->address;
+	uint32_t end = desc->address + desc->size;
+	unsigned long steps = BIT(step);
+	size_t max_read = NS2_FLASH_READ_MAX;
+	int i;
+
+	if (ns2->cfg->max_reply)
+		max_read = min(max_read, ns2->cfg->max_reply - NS2_FLASH_READ_REPLY_OVERHEAD);
+
+	for (i = step + 1; i < NS2_INIT_DONE; i++) {
+		const struct switch2_init_desc *other = &switch2_init_steps[i];
+		uint32_t merged_start, merged_end;
+
+		if (other->command != NS2_CMD_FLASH)
+			continue;
+		if (!switch2_init_step_ready(ns2, i) || !switch2_init_step_needed(ns2, i))
+			continue;
+
+		merged_start = min(start, other->address);
+		merged_end = max(end, other->address + other->size);
+		if (merged_end - merged_start > max_read)
+			continue;
+
+		start = merged_start;
+		end = merged_end;
+		steps |= BIT(i);
+	}
+
+	*address = start;
+	*size = end - start;
+	return steps;
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_init_plan_flash_read);
+
+static int switch2_init_send_step(struct switch2_controller *ns2,
+	enum switch2_init_step step, struct switch2_cmd_request *req)
+{
+	switch (step) {
+	case NS2_INIT_GET_FIRMWARE_INFO:
+		return switch2_cmd_send(ns2, req, NS2_CMD_FW_INFO, NS2_SUBCMD_FW_INFO_GET,
+			NULL, 0);
+	case NS2_INIT_SET_FEATURE_MASK:
+		return switch2_features_cmd(ns2, req, NS2_SUBCMD_FEATSEL_SET_MASK,
+			ns2->features);
+	case NS2_INIT_ENABLE_FEATURES:
+		return switch2_features_cmd(ns2, req, NS2_SUBCMD_FEATSEL_ENABLE,
+			ns2->features);
+#ifdef CONFIG_SWITCH2_FF
+	case NS2_INIT_ENABLE_RUMBLE:
+		return switch2_cmd_send(ns2, req, NS2_CMD_NFC, 1,
+			switch2_zero_data, sizeof(switch2_zero_data));
+#endif
+	case NS2_INIT_GRIP_BUTTONS:
+		return switch2_cmd_send(ns2, req, NS2_CMD_GRIP, NS2_SUBCMD_GRIP_ENABLE_BUTTONS,
+			switch2_one_data, sizeof(switch2_one_data));
+	case NS2_INIT_SET_PLAYER_LEDS:
+		return switch2_set_player_id(ns2, req, ns2->player_id);
+	case NS2_INIT_SELECT_REPORT:
+		return switch2_cmd_send(ns2, req, NS2_CMD_INIT, NS2_SUBCMD_INIT_SELECT_REPORT,
+			switch2_unified_report_data, sizeof(switch2_unified_report_data));
+	case NS2_INIT_INPUT:
+		return switch2_cmd_send(ns2, req, NS2_CMD_INIT, NS2_SUBCMD_INIT_USB,
+			switch2_init_cmd_data, sizeof(switch2_init_cmd_data));
+	default:
+		WARN_ON_ONCE(1);
+		return -EINVAL;
+	}
+}
+
+/*
+ * A step that still fails after its retries is marked done anyway, so that
+ * the controller comes up with default calibration rather than not at all.
+ */
+static void switch2_init_step_complete(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, const uint8_t *reply, size_t length)
+{
+	unsigned long steps = req->context & ns2->init_sent & ~ns2->init_done;
+	u32 duration = ktime_us_delta(ktime_get(), req->queued);
+	int step;
+
+	if (!steps)
+		return;
+
+	for_each_set_bit(step, &steps, NS2_INIT_DONE)
+		ns2->init_step_us[step] = duration;
+	ns2->init_done |= steps;
+	ns2->init_inflight--;
+	if ((steps & NS2_INIT_BIT(GET_FIRMWARE_INFO)) && !req->status &&
+	    switch2_calib_cache_restore(ns2)) {
+		switch2_dbg(ns2, "Using cached calibration for %s\n", ns2->serial);
+		if (switch2_publish_calibration(ns2))
+			switch2_warn(ns2, "Failed to update calibration\n");
+		ns2->init_sent |= NS2_INIT_CACHED_STEPS;
+		ns2->init_done |= NS2_INIT_CACHED_STEPS;
+	}
+}
+
+int switch2_init_controller(struct switch2_controller *ns2)
+{
+	struct switch2_cmd_request *req;
+	unsigned int depth;
+	bool progress;
+	int step;
+	int ret;
+
+	lockdep_assert_held(&ns2->lock);
+
+	if (ns2->init_done & BIT(NS2_INIT_DONE))
+		return 0;
+
+	if (!ns2->cfg)
+		return -ENOTCONN;
+
+	/* Resume picks up from here */
+	if (ns2->suspended)
+		return 0;
+
+	if (!ns2->init_sent)
+		ns2->init_start = ktime_get();
+
+	depth = max(ns2->cfg->queue_depth, 1u);
+	do {
+		progress = false;
+		for (step = NS2_INIT_READ_SERIAL; step <= NS2_INIT_DONE; step++) {
+			unsigned long steps = BIT(step);
+
+			if (!switch2_init_step_ready(ns2, step))
+				continue;
+
+			if (!switch2_init_step_needed(ns2, step)) {
+				ns2->init_sent |= BIT(step);
+				ns2->init_done |= BIT(step);
+				progress = true;
+				continue;
+			}
+
+			if (step == NS2_INIT_DONE) {
+				if (!ns2->hdev)
+					return 0;
+				ns2->init_sent |= BIT(step);
+				ns2->init_done |= BIT(step);
+				ns2->init_us = ktime_us_delta(ktime_get(), ns2->init_start);
+				switch2_calib_cache_store(ns2);
+				/* Registering input devices is slow, keep it out of the response path */
+				switch2_schedule_init(ns2);
+				return 0;
+			}
+
+			/* Leave the rest for when a response frees up a slot */
+			if (ns2->init_inflight >= depth)
+				return 0;
+
+			req = &ns2->init_requests[step];
+			req->complete = switch2_init_step_complete;
+			if (switch2_init_steps[step].command == NS2_CMD_FLASH) {
+				uint32_t address;
+				uint8_t size;
+
+				steps = switch2_init_plan_flash_read(ns2, step, &address, &size);
+				req->context = steps;
+				ret = switch2_read_flash(ns2, req, address, size);
+			} else {
+				req->context = steps;
+				ret = switch2_init_send_step(ns2, step, req);
+			}
+			if (ret < 0)
+				return ret;
+			ns2->init_sent |= steps;
+			ns2->init_inflight++;
+		}
+	} while (progress);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(switch2_init_controller);
+
+/*
+ * Each controller finishes init from its own work item on the unbound
+ * workqueue, so probes return right away and controllers that enumerate
+ * together don't wait for each other.
+ */
+static void switch2_init_work(struct work_struct *work)
+{
+	struct switch2_controller *ns2 = container_of(work, struct switch2_controller,
+		init_work);
+	int ret;
+
+	guard(mutex)(&ns2->lock);
+	if (!ns2->hdev || !ns2->cfg)
+		return;
+
+	if (ns2->init_done & BIT(NS2_INIT_DONE))
+		ret = switch2_init_input(ns2);
+	else
+		ret = switch2_init_controller(ns2);
+	if (ret)
+		hid_err(ns2->hdev, "Failed to initialize controller: %d\n", ret);
+}
+
+/* Called once either interface is attached, and once init is done */
+void switch2_schedule_init(struct switch2_controller *ns2)
+{
+	queue_work(system_unbound_wq, &ns2->init_work);
+}
+EXPORT_SYMBOL_GPL(switch2_schedule_init);
+
+/*
+ * The first interface to suspend drops whatever is in flight and forgets the
+ * state-setting init steps. Serial, firmware info and calibration are kept, as
+ * are the input devices and the player ID, so once the last interface resumes
+ * init only has to replay a handful of commands.
+ */
+void switch2_controller_suspend(struct switch2_controller *ns2, unsigned int interface)
+{
+	guard(mutex)(&ns2->lock);
+	if (!ns2->suspended) {
+		switch2_cmd_cancel_all(ns2);
+		ns2->init_inflight = 0;
+		ns2->init_done &= ~NS2_INIT_STATE_STEPS;
+		/* Steps that were in flight went with their cancelled requests */
+		ns2->init_sent = ns2->init_done;
+	}
+	WRITE_ONCE(ns2->suspended, ns2->suspended | interface);
+}
+EXPORT_SYMBOL_GPL(switch2_controller_suspend);
+
+void switch2_controller_resume(struct switch2_controller *ns2, unsigned int interface)
+{
+	scoped_guard(mutex, &ns2->lock) {
+		WRITE_ONCE(ns2->suspended, ns2->suspended & ~interface);
+		if (ns2->suspended)
+			return;
+		ns2->init_start = ktime_get();
+		/* The optical sensor may have started counting over */
+		ns2->mouse_synced = false;
+	}
+	switch2_schedule_init(ns2);
+}
+EXPORT_SYMBOL_GPL(switch2_controller_resume);
+
+/*
+ * A single read may cover several of the blocks we care about, so hand each
+ * of the init @steps it was planned for to the per-block parser.
+ */
+/* Returns whether the reply covered anything init reads */
+static bool switch2_handle_flash_reply(struct switch2_controller *ns2, unsigned long steps,
+	uint8_t size, uint32_t address, const uint8_t *data)
+{
+	bool handled = false;
+	int step;
+
+	for_each_set_bit(step, &steps, NS2_INIT_DONE) {
+		const struct switch2_init_desc *desc = &switch2_init_steps[step];
+
+		if (desc->command != NS2_CMD_FLASH)
+			continue;
+		if (desc->address < address ||
+		    desc->address + desc->size > address + size)
+			continue;
+		switch2_handle_flash_read(ns2, desc->size, desc->address,
+			&data[desc->address - address]);
+		handled = true;
+	}
+	return handled;
+}
+
+/*
+ * Only init's own reads feed calibration. Flash dumps and firmware verify
+ * reads cover the same blocks but must never republish them.
+ */
+static bool switch2_cmd_is_init_step(const struct switch2_controller *ns2,
+	const struct switch2_cmd_request *req)
+{
+	return req && req->complete == switch2_init_step_complete &&
+	       req >= ns2->init_requests &&
+	       req < ns2->init_requests + ARRAY_SIZE(ns2->init_requests);
+}
+
+/* Whether switch2_handle_command() does anything with this response */
+static bool switch2_cmd_has_handler(const struct switch2_cmd_header *header)
+{
+	return (header->command == NS2_CMD_FLASH &&
+		header->subcommand == NS2_SUBCMD_FLASH_READ) ||
+	       (header->command == NS2_CMD_FW_INFO &&
+		header->subcommand == NS2_SUBCMD_FW_INFO_GET);
+}
+
+static int switch2_handle_command(struct switch2_controller *ns2,
+	const struct switch2_cmd_header *header, const struct switch2_cmd_request *req,
+	const uint8_t *message, size_t length)
+{
+	switch (header->command) {
+	case NS2_CMD_FLASH:
+		if (header->subcommand == NS2_SUBCMD_FLASH_READ) {
+			uint8_t read_size;
+			uint32_t read_address;
+
+			if (!switch2_cmd_is_init_step(ns2, req))
+				break;
+			if (length < 16)
+				return -EINVAL;
+			read_size = message[0];
+			read_address = __le32_to_cpu(*(__le32 *)&message[4]);
+			if (length < read_size + 16)
+				return -EINVAL;
+			if (switch2_handle_flash_reply(ns2, req->context & ~ns2->init_done,
+						       read_size, read_address, &message[8]) &&
+			    switch2_publish_calibration(ns2))
+				switch2_warn(ns2, "Failed to update calibration\n");
+		}
 		break;
-	case NS2_CTLR_TYPE_PRO:
-		input_set_abs_params(input, ABS_X, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_Y, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_RX, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_RY, NS2_AXIS_MIN, NS2_AXIS_MAX, 32, 128);
-		input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
-		input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
-		switch2_config_buttons(input, procon_mappings);
+	case NS2_CMD_FW_INFO:
+		if (header->subcommand == NS2_SUBCMD_FW_INFO_GET) {
+			if (length < sizeof(*header) + sizeof(ns2->version))
+				return -EINVAL;
+			memcpy(&ns2->version, message, sizeof(ns2->version));
+			ns2->ctlr_type = ns2->version.ctlr_type;
+		}
+		break;
+	default:
 		break;
+	}
+
+	return 0;
+}
+
+int switch2_receive_command(struct switch2_controller *ns2,
+	const uint8_t *message, size_t length)
+{
+	const struct switch2_cmd_header *header;
+	struct switch2_cmd_request *req;
+	int ret = 0;
+
+	if (length < 8)
+		return -EINVAL;
+
+	print_hex_dump_debug("got cmd: ", DUMP_PREFIX_OFFSET, 16, 1, message, length, false);
+
+	guard(mutex)(&ns2->lock);
+
+	header = (const struct switch2_cmd_header *)message;
+	/* Parsing needs to know who asked, and must happen before they are told */
+	req = switch2_cmd_claim(ns2, header, &message[8], length - 8);
+	if (!(header->direciton & NS2_FLAG_NACK))
+		ret = switch2_handle_command(ns2, header, req, &message[8], length);
+	if (req)
+		switch2_cmd_answer(ns2, req, header, &message[8], length - 8);
+
+	trace_switch2_receive_command(ns2->phys, header->command, header->subcommand,
+		header->direciton, length, req != NULL);
+	if (!req)
+		switch2_dbg(ns2, "Unsolicited response %02x:%02x\n", header->command,
+			header->subcommand);
+
+	if (!(ns2->init_done & BIT(NS2_INIT_DONE)))
+		switch2_init_controller(ns2);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(switch2_receive_command);
+
+/*
+ * Called from the transport's URB completion, so it must not sleep. Consumes
+ * responses that only need the request list: ACKs nothing is tracking, and
+ * replies to requests that have a waiter but no callback. Returns false for
+ * anything else, which must then go to switch2_receive_command().
+ */
+bool switch2_receive_command_atomic(struct switch2_controller *ns2,
+	const uint8_t *message, size_t length)
+{
+	const struct switch2_cmd_header *header = (const struct switch2_cmd_header *)message;
+	struct switch2_cmd_request *req;
+
+	/* NACKs are retried, which may need to wait for the transport */
+	if (length < 8 || (header->direciton & NS2_FLAG_NACK) ||
+	    switch2_cmd_has_handler(header))
+		return false;
+
+	scoped_guard(spinlock_irqsave, &ns2->cmd_lock) {
+		req = switch2_cmd_find(ns2, header, &message[8], length - 8);
+		if (req && req->complete)
+			return false;
+		if (req)
+			list_del_init(&req->entry);
+	}
+
+	trace_switch2_receive_command(ns2->phys, header->command, header->subcommand,
+		header->direciton, length, req != NULL);
+	if (!req)
+		return true;
+
+	switch2_cmd_account_rtt(ns2, req);
+	req->status = 0;
+	/* The waiter may free @req as soon as this returns */
+	complete_all(&req->done);
+	return true;
+}
+EXPORT_SYMBOL_GPL(switch2_receive_command_atomic);
+
+/*
+ * Always inlined so that each call site, with its constant mapping table, is
+ * unrolled into a straight run of mask tests for that controller type.
+ */
+static __always_inline void switch2_report_buttons(struct input_dev *input,
+	uint32_t state, uint32_t changed,
+	const struct switch2_ctlr_button_mapping button_mappings[], size_t count)
+{
+	size_t i;
+
+	if (!changed)
+		return;
+
+	for (i = 0; i < count; i++) {
+		if (changed & button_mappings[i].mask)
+			input_report_key(input, button_mappings[i].code,
+				state & button_mappings[i].mask);
+	}
+}
+
+static void switch2_report_dpad(struct input_dev *input, uint32_t state,
+	const struct switch2_report_layout *layout)
+{
+	input_report_abs(input, ABS_HAT0X,
+		!!(state & layout->dpad_right) - !!(state & layout->dpad_left));
+	input_report_abs(input, ABS_HAT0Y,
+		!!(state & layout->dpad_down) - !!(state & layout->dpad_up));
+}
+
+static int switch2_axis_value(const struct switch2_axis_calibration *calib, int value,
+	bool negate)
+{
+	value -= calib->center;
+	if (value < 0)
+		value = -(int)(((uint64_t)-value * calib->negative_scale) >> calib->negative_shift);
+	else
+		value = ((uint64_t)value * calib->positive_scale) >> calib->positive_shift;
+
+	if (negate)
+		value = -value;
+	return clamp(value, NS2_AXIS_MIN, NS2_AXIS_MAX);
+}
+
+static void switch2_report_axis(struct input_dev *input, const struct switch2_axis_calibration *calib,
+	int axis, int value, bool negate)
+{
+	input_report_abs(input, axis, switch2_axis_value(calib, value, negate));
+}
+
+static void switch2_report_stick(struct input_dev *input,
+	const struct switch2_stick_calibration *calib,
+	int x, int y, const uint8_t *data)
+{
+	switch2_report_axis(input, &calib->x, x, data[0] | ((data[1] & 0x0F) << 8), false);
+	switch2_report_axis(input, &calib->y, y, (data[1] >> 4) | (data[2] << 4), true);
+}
+
+static void switch2_pair_emit(struct switch2_pair *pair)
+{
+	struct input_dev *input = pair->input;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pair->side); i++) {
+		struct switch2_pair_slot *slot = &pair->side[i];
+		const struct switch2_report_layout *layout = READ_ONCE(slot->layout);
+		uint64_t state = atomic64_read(&slot->state);
+		uint32_t buttons = state >> 32;
+		uint32_t changed = buttons ^ slot->reported;
+
+		if (!layout)
+			continue;
+		slot->reported = buttons;
+
+		if (changed & (layout->dpad_up | layout->dpad_down |
+			       layout->dpad_left | layout->dpad_right))
+			switch2_report_dpad(input, buttons, layout);
+		switch2_report_buttons(input, buttons, changed, layout->mappings,
+			layout->mapping_count);
+		input_report_abs(input, layout->sticks[0].x, (int16_t)(state >> 16));
+		input_report_abs(input, layout->sticks[0].y, (int16_t)state);
+	}
+	input_sync(input);
+}
+
+static void switch2_pair_publish(struct switch2_pair *pair, unsigned int side,
+	const struct switch2_report_layout *layout, uint64_t state)
+{
+	struct switch2_pair_slot *slot = &pair->side[side];
+	int pending;
+
+	WRITE_ONCE(slot->layout, layout);
+	atomic64_set(&slot->state, state);
+
+	/* Fully ordered, so whoever is emitting sees the slot once it sees this */
+	if (atomic_inc_return(&pair->pending) != 1)
+		return;
+
+	do {
+		pending = atomic_read(&pair->pending);
+		switch2_pair_emit(pair);
+	} while (atomic_sub_return(pending, &pair->pending));
+}
+
+/* @stick is NULL to keep the stick where it was */
+static void switch2_pair_update(struct switch2_pair *pair, enum switch2_ctlr_type type,
+	const struct switch2_report_layout *layout, uint32_t buttons,
+	const struct switch2_stick_calibration *calib, const uint8_t *stick)
+{
+	unsigned int side = type == NS2_CTLR_TYPE_JCR;
+	uint64_t state = (uint32_t)atomic64_read(&pair->side[side].state);
+
+	if (stick)
+		state = (uint64_t)(uint16_t)switch2_axis_value(&calib->x,
+				stick[0] | ((stick[1] & 0x0F) << 8), false) << 16 |
+			(uint16_t)switch2_axis_value(&calib->y,
+				(stick[1] >> 4) | (stick[2] << 4), true);
+
+	switch2_pair_publish(pair, side, layout, (uint64_t)buttons << 32 | state);
+}
+
+static void switch2_report_trigger(struct input_dev *input, uint8_t zero, int abs, uint8_t data)
+{
+	int value = (NS2_TRIGGER_RANGE + 1) * (data - zero) / (232 - zero);
+
+	input_report_abs(input, abs, clamp(value, 0, NS2_TRIGGER_RANGE));
+}
+
+/*
+ * Every sample gets its own frame so none of them is collapsed into the next
+ * by evdev, but they are all emitted back to back from the same report.
+ * MSC_TIMESTAMP carries the controller's clock rather than the host's, so
+ * userspace can integrate without USB polling jitter.
+ */
+static void switch2_report_imu(struct input_dev *imu, const uint8_t *raw_data,
+	const struct switch2_report_layout *layout)
+{
+	uint32_t timestamp = get_unaligned_le32(&raw_data[layout->imu_timestamp]);
+	unsigned int i;
+
+	timestamp -= (layout->imu_samples - 1) * layout->imu_period;
+	for (i = 0; i < layout->imu_samples; i++) {
+		const uint8_t *sample = &raw_data[layout->imu + i * NS2_IMU_SAMPLE_SIZE];
+
+		input_event(imu, EV_MSC, MSC_TIMESTAMP, timestamp);
+		input_report_abs(imu, ABS_X, (int16_t)get_unaligned_le16(&sample[0]));
+		input_report_abs(imu, ABS_Y, (int16_t)get_unaligned_le16(&sample[2]));
+		input_report_abs(imu, ABS_Z, (int16_t)get_unaligned_le16(&sample[4]));
+		input_report_abs(imu, ABS_RX, (int16_t)get_unaligned_le16(&sample[6]));
+		input_report_abs(imu, ABS_RY, (int16_t)get_unaligned_le16(&sample[8]));
+		input_report_abs(imu, ABS_RZ, (int16_t)get_unaligned_le16(&sample[10]));
+		input_sync(imu);
+		timestamp += layout->imu_period;
+	}
+}
+
+/* Stick tilt below this doesn't scroll, so a resting stick never drifts */
+#define NS2_MOUSE_WHEEL_DEADZONE	(NS2_AXIS_MAX / 4)
+
+/*
+ * The optical sensor's counters wrap, so motion is the difference from the
+ * previous report. Scaling keeps whatever fraction of a count it cuts off and
+ * carries it into the next report, so slow motion isn't lost. The stick
+ * scrolls the same way, in high-resolution wheel units of 1/120 notch.
+ */
+static void switch2_report_mouse(struct switch2_controller *ns2, struct input_dev *mouse,
+	const struct switch2_stick_calibration *calib, const uint8_t *raw_data,
+	uint32_t state, uint32_t changed, const struct switch2_report_layout *layout)
+{
+	const uint8_t *stick = &raw_data[layout->sticks[0].offset];
+	int scale = DIV_ROUND_CLOSEST(clamp(READ_ONCE(mouse_scale), 1u, 1000u) * 256, 100);
+	int wheel = min(READ_ONCE(mouse_wheel), 960u);
+	int tilt[2];
+	int out[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		uint16_t count = get_unaligned_le16(&raw_data[layout->mouse + 2 * i]);
+		int delta = ns2->mouse_synced ? (int16_t)(count - ns2->mouse_last[i]) : 0;
+
+		ns2->mouse_last[i] = count;
+		ns2->mouse_rem[i] += delta * scale;
+		out[i] = ns2->mouse_rem[i] >> 8;
+		ns2->mouse_rem[i] -= out[i] * 256;
+	}
+	ns2->mouse_synced = true;
+	input_report_rel(mouse, REL_X, out[0]);
+	input_report_rel(mouse, REL_Y, out[1]);
+
+	/* Tilting the stick up scrolls up, which is the opposite of ABS_Y */
+	tilt[0] = switch2_axis_value(&calib->x, stick[0] | ((stick[1] & 0x0F) << 8), false);
+	tilt[1] = switch2_axis_value(&calib->y, (stick[1] >> 4) | (stick[2] << 4), false);
+	for (i = 0; i < 2; i++) {
+		if (abs(tilt[i]) < NS2_MOUSE_WHEEL_DEADZONE)
+			tilt[i] = 0;
+		ns2->wheel_rem[i] += tilt[i] * wheel;
+		out[i] = ns2->wheel_rem[i] >> 15;
+		ns2->wheel_rem[i] -= out[i] * 32768;
+		ns2->wheel_hi_res[i] += out[i];
+	}
+	input_report_rel(mouse, REL_HWHEEL_HI_RES, out[0]);
+	input_report_rel(mouse, REL_WHEEL_HI_RES, out[1]);
+	for (i = 0; i < 2; i++) {
+		out[i] = ns2->wheel_hi_res[i] / 120;
+		ns2->wheel_hi_res[i] -= out[i] * 120;
+	}
+	input_report_rel(mouse, REL_HWHEEL, out[0]);
+	input_report_rel(mouse, REL_WHEEL, out[1]);
+
+	switch2_report_buttons(mouse, state, changed, layout->mouse_mappings,
+		layout->mouse_mapping_count);
+	input_sync(mouse);
+}
+
+/*
+ * Every caller passes a constant layout, so inlining this turns it back into
+ * a decoder specialised for that single report format.
+ */
+static __always_inline int switch2_decode_report(struct switch2_controller *ns2,
+	struct input_dev *input, struct input_dev *imu, struct input_dev *mouse,
+	struct switch2_pair *pair,
+	const struct switch2_calibration *calib, const uint8_t *raw_data,
+	int size, const struct switch2_report_layout *layout)
+{
+	uint32_t dpad = layout->dpad_up | layout->dpad_down |
+		layout->dpad_left | layout->dpad_right;
+	uint32_t features = READ_ONCE(ns2->features);
+	bool analog = features & NS2_FEATURE_ANALOG;
+	bool motion = layout->imu_samples && imu && (features & NS2_FEATURE_IMU);
+	bool pointer = layout->mouse && mouse && (features & NS2_FEATURE_MOUSE);
+	uint64_t axes = 0;
+	uint32_t changed;
+	uint32_t state;
+	unsigned int i;
+
+	if (size < layout->size)
+		return -EINVAL;
+
+	/* Whatever the controller was told not to send is left alone */
+	if (features & NS2_FEATURE_BUTTONS)
+		state = get_unaligned_le32(&raw_data[layout->buttons]) & layout->button_bits;
+	else
+		state = ns2->last_buttons;
+
+	/*
+	 * Most reports repeat the previous one while the controller is idle.
+	 * Those would only produce an empty frame, which input core drops anyway,
+	 * so skip them before doing any of the stick math.
+	 */
+	for (i = 0; analog && i < layout->stick_count; i++)
+		axes = axes << 24 | get_unaligned_le24(&raw_data[layout->sticks[i].offset]);
+	if (analog && layout->triggers)
+		axes = axes << 16 | get_unaligned_le16(&raw_data[layout->triggers]);
+	if (state == ns2->last_buttons && axes == ns2->last_axes &&
+	    calib->generation == ns2->last_calib_gen && !motion && !pointer) {
+		switch2_stat_inc(ns2, reports_deduped);
+		return 0;
+	}
+	ns2->last_axes = axes;
+	ns2->last_calib_gen = calib->generation;
+
+	changed = state ^ ns2->last_buttons;
+	ns2->last_buttons = state;
+
+	/* A paired Joy-Con only has one stick and no triggers */
+	if (pair) {
+		const struct switch2_stick_layout *stick = &layout->sticks[0];
+
+		switch2_pair_update(pair, ns2->ctlr_type, layout, state,
+			&calib->stick[stick->calib], analog ? &raw_data[stick->offset] : NULL);
+		goto motion;
+	}
+
+	if (changed & dpad)
+		switch2_report_dpad(input, state, layout);
+	switch2_report_buttons(input, state, changed, layout->mappings,
+		layout->mapping_count);
+
+	for (i = 0; analog && i < layout->stick_count; i++) {
+		const struct switch2_stick_layout *stick = &layout->sticks[i];
+
+		switch2_report_stick(input, &calib->stick[stick->calib],
+			stick->x, stick->y, &raw_data[stick->offset]);
+	}
+
+	if (analog && layout->triggers) {
+		switch2_report_trigger(input, calib->lt_zero, ABS_Z, raw_data[layout->triggers]);
+		switch2_report_trigger(input, calib->rt_zero, ABS_RZ, raw_data[layout->triggers + 1]);
+	}
+
+	input_sync(input);
+	trace_switch2_event_done(ns2->phys, raw_data[0], ns2->report_seq, size);
+
+motion:
+	if (motion)
+		switch2_report_imu(imu, raw_data, layout);
+	if (pointer)
+		switch2_report_mouse(ns2, mouse, &calib->stick[layout->sticks[0].calib],
+			raw_data, state, changed, layout);
+	else
+		ns2->mouse_synced = false;
+	return 0;
+}
+
+VISIBLE_IF_KUNIT int switch2_decode(struct switch2_controller *ns2, struct input_dev *input,
+	struct input_dev *imu, struct input_dev *mouse, struct switch2_pair *pair,
+	const struct switch2_calibration *calib, uint8_t id,
+	const uint8_t *raw_data, int size)
+{
+	switch (id) {
+	case NS2_REPORT_UNIFIED:
+		switch (ns2->ctlr_type) {
+		case NS2_CTLR_TYPE_JCL:
+			return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+				raw_data, size, &switch2_unified_layouts[NS2_CTLR_TYPE_JCL]);
+		case NS2_CTLR_TYPE_JCR:
+			return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+				raw_data, size, &switch2_unified_layouts[NS2_CTLR_TYPE_JCR]);
+		case NS2_CTLR_TYPE_PRO:
+			return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+				raw_data, size, &switch2_unified_layouts[NS2_CTLR_TYPE_PRO]);
+		case NS2_CTLR_TYPE_GC:
+			return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+				raw_data, size, &switch2_unified_layouts[NS2_CTLR_TYPE_GC]);
+		default:
+			return -EINVAL;
+		}
+	case NS2_REPORT_JCL:
+		return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+			raw_data, size, &switch2_jcl_layout);
+	case NS2_REPORT_JCR:
+		return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+			raw_data, size, &switch2_jcr_layout);
+	case NS2_REPORT_GC:
+		return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+			raw_data, size, &switch2_gccon_layout);
+	case NS2_REPORT_PRO:
+		return switch2_decode_report(ns2, input, imu, mouse, pair, calib,
+			raw_data, size, &switch2_procon_layout);
 	default:
-		input_free_device(input);
 		return -EINVAL;
 	}
+}
+EXPORT_SYMBOL_IF_KUNIT(switch2_decode);
+
+static int switch2_event(struct hid_device *hdev, struct hid_report *report, uint8_t *raw_data,
+	int size)
+{
+	struct switch2_controller *ns2 = hid_get_drvdata(hdev);
+	const struct switch2_calibration *calib;
+	struct switch2_raw_ring *raw;
+	struct switch2_pair *pair;
+	struct input_dev *input;
+	struct input_dev *mouse;
+	struct input_dev *imu;
+
+	if (report->type != HID_INPUT_REPORT)
+		return 0;
+
+	trace_switch2_event(ns2->phys, report->id, ++ns2->report_seq, size);
+	if (report->id < NS2_STATS_REPORT_IDS)
+		switch2_stat_inc(ns2, reports[report->id]);
+
+	if (size < 15)
+		return -EINVAL;
+
+	/* Everything below uses one consistent snapshot */
+	guard(rcu)();
+	input = rcu_dereference(ns2->input);
+	imu = rcu_dereference(ns2->imu);
+	mouse = rcu_dereference(ns2->mouse);
+	calib = rcu_dereference(ns2->calib);
+	raw = rcu_dereference(ns2->raw);
+	pair = rcu_dereference(ns2->pair);
+
+	if (raw)
+		switch2_raw_push(raw, report->id, raw_data, size);
+	if (!input)
+		return 0;
+
+	return switch2_decode(ns2, input, imu, mouse, pair, calib, report->id, raw_data,
+		size);
+}
+
+/*
+ * Replay of captured traffic into detached controllers, for load testing
+ * without hardware. A capture written to debugfs hid-switch2/replay is a
+ * sequence of records, each a kind byte, a length byte and that many bytes
+ * of payload: NS2_REPLAY_BULK_IN records are command responses as read from
+ * the bulk-in endpoint, NS2_REPLAY_REPORT records are HID input reports
+ * starting with their report id. Each of replay_controllers virtual
+ * controllers runs the init sequence against the captured responses and then
+ * decodes the captured reports replay_loops times, all in parallel. With
+ * replay_sweep set, the reports are then decoded again on a single CPU for
+ * 1, 2, 4, ... and finally all of the controllers in turn. Reading the file
+ * shows the results of the last run.
+ */
+#define NS2_REPLAY_BULK_IN	'B'
+#define NS2_REPLAY_REPORT	'R'
+#define NS2_REPLAY_MAX_SIZE	SZ_1M
+#define NS2_REPLAY_MAX_CONTROLLERS 64
+/* Doubling from 1, the last step is at most NS2_REPLAY_MAX_CONTROLLERS */
+#define NS2_REPLAY_SWEEP_STEPS	7
+static_assert(NS2_REPLAY_MAX_CONTROLLERS <= 1 << (NS2_REPLAY_SWEEP_STEPS - 1));
+
+struct switch2_replay {
+	struct work_struct work;
+	struct switch2_cfg_intf cfg;
+	struct switch2_controller *ns2;
+	struct input_dev *input;
+	const uint8_t *capture;
+	size_t size;
+	unsigned int loops;
+
+	unsigned int commands;
+	bool initialised;
+	u64 init_ns;
+	u64 reports;
+	int status;
+};
+
+static DEFINE_MUTEX(switch2_replay_lock);
+static u32 switch2_replay_controllers = 1;
+static u32 switch2_replay_loops = 1000;
+static bool switch2_replay_sweep;
+
+static struct {
+	unsigned int controllers;
+	unsigned int initialised;
+	unsigned int commands;
+	u64 init_ns_total;
+	u64 init_ns_max;
+	u64 reports;
+	u64 elapsed_ns;
+	int status;
+	unsigned int sweep_steps;
+	struct {
+		unsigned int controllers;
+		u64 ns_per_report;
+	} sweep[NS2_REPLAY_SWEEP_STEPS];
+} switch2_replay_result;
+
+/* Stands in for the bulk transport, every command is taken and dropped */
+static int switch2_replay_send_command(enum switch2_cmd command, uint8_t subcommand,
+	const void *message, size_t length, struct switch2_cfg_intf *cfg)
+{
+	struct switch2_replay *replay = container_of(cfg, struct switch2_replay, cfg);
+
+	replay->commands++;
+	return 0;
+}
+
+static void switch2_replay_init(struct switch2_replay *replay)
+{
+	const unsigned long steps = switch2_init_steps[NS2_INIT_DONE].depends;
+	struct switch2_controller *ns2 = replay->ns2;
+	unsigned long done = 0;
+	unsigned long now;
+	u64 start;
+	size_t pos;
+
+	start = ktime_get_ns();
+	scoped_guard(mutex, &ns2->lock)
+		replay->status = switch2_init_controller(ns2);
+
+	/*
+	 * A response is only matched if its command has already been sent, so
+	 * go over the capture again for as long as that gets init further.
+	 */
+	while (!replay->status) {
+		scoped_guard(mutex, &ns2->lock)
+			now = ns2->init_done;
+		if ((now & steps) == steps || now == done)
+			break;
+		done = now;
+		for (pos = 0; pos < replay->size; pos += 2 + replay->capture[pos + 1]) {
+			if (replay->capture[pos] == NS2_REPLAY_BULK_IN)
+				switch2_receive_command(ns2, &replay->capture[pos + 2],
+					replay->capture[pos + 1]);
+		}
+	}
+	replay->init_ns = ktime_get_ns() - start;
+
+	guard(mutex)(&ns2->lock);
+	replay->initialised = (ns2->init_done & steps) == steps;
+	switch2_cmd_cancel_all(ns2);
+}
+
+static void switch2_replay_work(struct work_struct *work)
+{
+	struct switch2_replay *replay = container_of(work, struct switch2_replay, work);
+	struct switch2_controller *ns2 = replay->ns2;
+	const struct switch2_calibration *calib;
+	struct input_dev *input;
+	unsigned int loop;
+	size_t pos;
+
+	switch2_replay_init(replay);
+	if (replay->status)
+		return;
+
+	/* Kept until the end of the run, for the sweep */
+	input = input_allocate_device();
+	if (!input) {
+		replay->status = -ENOMEM;
+		return;
+	}
+	replay->input = input;
+	replay->status = switch2_config_input(input, ns2->ctlr_type);
+	if (replay->status)
+		return;
+
+	/* Init is over, so nothing can replace the calibration any more */
+	calib = rcu_dereference_protected(ns2->calib, true);
+	for (loop = 0; loop < replay->loops; loop++) {
+		for (pos = 0; pos < replay->size; pos += 2 + replay->capture[pos + 1]) {
+			if (replay->capture[pos] != NS2_REPLAY_REPORT)
+				continue;
+			switch2_decode(ns2, input, NULL, NULL, NULL, calib, replay->capture[pos + 2],
+				&replay->capture[pos + 2], replay->capture[pos + 1]);
+			replay->reports++;
+		}
+		cond_resched();
+	}
+}
+
+/*
+ * Cycling through more and more controllers on one CPU means each report
+ * finds the state of the controller it is for colder in cache. If the cost
+ * per report stays flat from one controller up to all of them, a host with
+ * many controllers pays no more for each report than one with a single pad.
+ */
+static void switch2_replay_sweep_run(struct switch2_replay *replays, unsigned int count)
+{
+	unsigned int step = 0;
+	unsigned int loop;
+	unsigned int n;
+	unsigned int i;
+	size_t pos;
+
+	for (n = 1; step < NS2_REPLAY_SWEEP_STEPS; n = min(n * 2, count)) {
+		u64 reports = 0;
+		u64 start;
+
+		start = ktime_get_ns();
+		for (loop = 0; loop < replays[0].loops; loop++) {
+			for (pos = 0; pos < replays[0].size; pos += 2 + replays[0].capture[pos + 1]) {
+				const uint8_t *record = &replays[0].capture[pos];
+
+				if (record[0] != NS2_REPLAY_REPORT)
+					continue;
+				for (i = 0; i < n; i++) {
+					struct switch2_controller *ns2 = replays[i].ns2;
+
+					switch2_decode(ns2, replays[i].input, NULL, NULL, NULL,
+						rcu_dereference_protected(ns2->calib, true),
+						record[2], &record[2], record[1]);
+				}
+				reports += n;
+			}
+			cond_resched();
+		}
+
+		switch2_replay_result.sweep[step].controllers = n;
+		switch2_replay_result.sweep[step].ns_per_report =
+			div64_u64(ktime_get_ns() - start, max(reports, 1ULL));
+		step++;
+		if (n == count)
+			break;
+	}
+	switch2_replay_result.sweep_steps = step;
+}
+
+static int switch2_replay_validate(const uint8_t *capture, size_t size)
+{
+	size_t pos;
+
+	for (pos = 0; pos < size; pos += 2 + capture[pos + 1]) {
+		if (pos + 2 > size || pos + 2 + capture[pos + 1] > size)
+			return -EINVAL;
+		switch (capture[pos]) {
+		case NS2_REPLAY_BULK_IN:
+			if (capture[pos + 1] < sizeof(struct switch2_cmd_header))
+				return -EINVAL;
+			break;
+		case NS2_REPLAY_REPORT:
+			if (!capture[pos + 1])
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int switch2_replay_run(const uint8_t *capture, size_t size)
+{
+	unsigned int count = clamp(switch2_replay_controllers, 1u,
+		(u32)NS2_REPLAY_MAX_CONTROLLERS);
+	struct switch2_replay *replays;
+	unsigned int i;
+	u64 start;
+	int ret = 0;
+
+	replays = kcalloc(count, sizeof(*replays), GFP_KERNEL);
+	if (!replays)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		char phys[16];
+
+		snprintf(phys, sizeof(phys), "replay-%u", i);
+		replays[i].ns2 = switch2_alloc_controller(phys);
+		if (IS_ERR(replays[i].ns2)) {
+			ret = PTR_ERR(replays[i].ns2);
+			replays[i].ns2 = NULL;
+			goto out;
+		}
+		replays[i].cfg.parent = replays[i].ns2;
+		replays[i].cfg.queue_depth = NS2_INIT_DONE;
+		replays[i].cfg.send_command = switch2_replay_send_command;
+		replays[i].ns2->cfg = &replays[i].cfg;
+		replays[i].capture = capture;
+		replays[i].size = size;
+		replays[i].loops = switch2_replay_loops;
+		INIT_WORK(&replays[i].work, switch2_replay_work);
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < count; i++)
+		queue_work(system_unbound_wq, &replays[i].work);
+	for (i = 0; i < count; i++)
+		flush_work(&replays[i].work);
+
+	memset(&switch2_replay_result, 0, sizeof(switch2_replay_result));
+	switch2_replay_result.elapsed_ns = ktime_get_ns() - start;
+	switch2_replay_result.controllers = count;
+	for (i = 0; i < count; i++) {
+		switch2_replay_result.initialised += replays[i].initialised;
+		switch2_replay_result.commands += replays[i].commands;
+		switch2_replay_result.init_ns_total += replays[i].init_ns;
+		switch2_replay_result.init_ns_max = max(switch2_replay_result.init_ns_max,
+			replays[i].init_ns);
+		switch2_replay_result.reports += replays[i].reports;
+		if (replays[i].status && !switch2_replay_result.status)
+			switch2_replay_result.status = replays[i].status;
+	}
+	if (switch2_replay_sweep && !switch2_replay_result.status)
+		switch2_replay_sweep_run(replays, count);
+
+out:
+	for (i = 0; i < count; i++) {
+		input_free_device(replays[i].input);
+		if (!replays[i].ns2)
+			continue;
+		scoped_guard(mutex, &replays[i].ns2->lock)
+			replays[i].ns2->cfg = NULL;
+		switch2_free_controller(replays[i].ns2);
+	}
+	kfree(replays);
+	return ret;
+}
+
+static int switch2_replay_show(struct seq_file *s, void *unused)
+{
+	unsigned int i;
+
+	guard(mutex)(&switch2_replay_lock);
+
+	if (!switch2_replay_result.controllers)
+		return 0;
+
+	seq_printf(s, "controllers: %u\n", switch2_replay_result.controllers);
+	seq_printf(s, "initialised: %u\n", switch2_replay_result.initialised);
+	seq_printf(s, "commands: %u\n", switch2_replay_result.commands);
+	seq_printf(s, "init_us_avg: %llu\n",
+		div_u64(switch2_replay_result.init_ns_total,
+			switch2_replay_result.controllers * NSEC_PER_USEC));
+	seq_printf(s, "init_us_max: %llu\n",
+		div_u64(switch2_replay_result.init_ns_max, NSEC_PER_USEC));
+	seq_printf(s, "reports: %llu\n", switch2_replay_result.reports);
+	seq_printf(s, "elapsed_us: %llu\n",
+		div_u64(switch2_replay_result.elapsed_ns, NSEC_PER_USEC));
+	seq_printf(s, "reports_per_sec: %llu\n",
+		div64_u64(switch2_replay_result.reports * NSEC_PER_SEC,
+			max(switch2_replay_result.elapsed_ns, 1ULL)));
+	seq_printf(s, "status: %d\n", switch2_replay_result.status);
+	for (i = 0; i < switch2_replay_result.sweep_steps; i++)
+		seq_printf(s, "sweep_%u_ns_per_report: %llu\n",
+			switch2_replay_result.sweep[i].controllers,
+			switch2_replay_result.sweep[i].ns_per_report);
+	return 0;
+}
+
+static int switch2_replay_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switch2_replay_show, NULL);
+}
+
+static ssize_t switch2_replay_write(struct file *file, const char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	uint8_t *capture;
+	int ret;
+
+	if (!count || count > NS2_REPLAY_MAX_SIZE)
+		return -EINVAL;
+
+	capture = memdup_user(buf, count);
+	if (IS_ERR(capture))
+		return PTR_ERR(capture);
+
+	ret = switch2_replay_validate(capture, count);
+	if (!ret) {
+		guard(mutex)(&switch2_replay_lock);
+		ret = switch2_replay_run(capture, count);
+	}
+	kfree(capture);
+	return ret ? ret : count;
+}
+
+static const struct file_operations switch2_replay_fops = {
+	.owner		= THIS_MODULE,
+	.open		= switch2_replay_open,
+	.read		= seq_read,
+	.write		= switch2_replay_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+#define NS2_PIPELINE_WINDOW	8
+/* What fits in one flash command, and in one flash read reply */
+#define NS2_FLASH_CHUNK		48
+
+static void switch2_cmd_init_requests(struct switch2_cmd_request *reqs, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		INIT_LIST_HEAD(&reqs[i].entry);
+		init_completion(&reqs[i].done);
+	}
+}
+
+/*
+ * Send @count commands through @send, with up to NS2_PIPELINE_WINDOW of them
+ * in flight but no more than the transport queues. @reqs are reused in the
+ * order they were sent, so waiting for the oldest keeps the window full.
+ * @send is called with the controller lock held. @done, if not NULL, counts
+ * the commands that have completed. Returns the first error.
+ */
+static int switch2_cmd_pipeline(struct switch2_controller *ns2,
+	struct switch2_cmd_request reqs[NS2_PIPELINE_WINDOW], unsigned int count,
+	int (*send)(struct switch2_controller *ns2, struct switch2_cmd_request *req,
+		unsigned int index, void *context),
+	void *context, unsigned int *done)
+{
+	unsigned long busy = 0;
+	unsigned int window;
+	unsigned int slot = 0;
+	unsigned int i;
+	int ret = 0;
+
+	scoped_guard(mutex, &ns2->lock) {
+		if (!ns2->cfg)
+			return -ENOTCONN;
+		window = clamp(ns2->cfg->queue_depth, 1u, NS2_PIPELINE_WINDOW);
+	}
+
+	for (i = 0; i < count; i++) {
+		struct switch2_cmd_request *req = &reqs[slot];
+
+		if (busy & BIT(slot)) {
+			wait_for_completion(&req->done);
+			busy &= ~BIT(slot);
+			ret = req->status;
+			if (ret)
+				break;
+			if (done)
+				WRITE_ONCE(*done, *done + 1);
+		}
+
+		scoped_guard(mutex, &ns2->lock)
+			ret = send(ns2, req, i, context);
+		if (ret)
+			break;
+		busy |= BIT(slot);
+		slot = (slot + 1) % window;
+	}
+
+	/* Let everything still in flight finish, keeping the first error */
+	for_each_set_bit(slot, &busy, NS2_PIPELINE_WINDOW) {
+		wait_for_completion(&reqs[slot].done);
+		if (!ret)
+			ret = reqs[slot].status;
+		if (!ret && done)
+			WRITE_ONCE(*done, *done + 1);
+	}
+	return ret;
+}
+
+/*
+ * Reads of the flash attribute are served from a few cached pages. Dumps read
+ * sequentially, so a miss fetches the page and the ones after it in a single
+ * pipelined pass.
+ */
+#define NS2_FLASH_SIZE		SZ_2M
+#define NS2_FLASH_PAGE		SZ_4K
+#define NS2_FLASH_CACHE_PAGES	8
+#define NS2_FLASH_READAHEAD	4
+#define NS2_FLASH_PAGE_READS	DIV_ROUND_UP(NS2_FLASH_PAGE, NS2_FLASH_CHUNK)
+
+struct switch2_flash_page {
+	/* U32_MAX while empty */
+	uint32_t address;
+	unsigned long used;
+	uint8_t data[NS2_FLASH_PAGE];
+};
+
+struct switch2_flash_cache {
+	/* Serialises readers, taken outside the controller lock */
+	struct mutex lock;
+	unsigned long clock;
+	uint32_t fill_address;
+	struct switch2_flash_page *fill[NS2_FLASH_READAHEAD];
+	struct switch2_cmd_request req[NS2_PIPELINE_WINDOW];
+	struct switch2_flash_page pages[NS2_FLASH_CACHE_PAGES];
+};
+
+static struct switch2_flash_cache *switch2_flash_get_cache(struct switch2_controller *ns2)
+{
+	struct switch2_flash_cache *cache;
+	size_t i;
+
+	guard(mutex)(&ns2->lock);
+	if (ns2->flash_cache)
+		return ns2->flash_cache;
+
+	cache = vzalloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+	mutex_init(&cache->lock);
+	switch2_cmd_init_requests(cache->req, ARRAY_SIZE(cache->req));
+	for (i = 0; i < ARRAY_SIZE(cache->pages); i++)
+		cache->pages[i].address = U32_MAX;
+	ns2->flash_cache = cache;
+	return cache;
+}
+
+static void switch2_flash_free_cache(struct switch2_flash_cache *cache)
+{
+	if (!cache)
+		return;
+	mutex_destroy(&cache->lock);
+	vfree(cache);
+}
+
+static void switch2_flash_invalidate(struct switch2_controller *ns2)
+{
+	struct switch2_flash_cache *cache;
+	size_t i;
+
+	scoped_guard(mutex, &ns2->lock)
+		cache = ns2->flash_cache;
+	if (!cache)
+		return;
+
+	guard(mutex)(&cache->lock);
+	for (i = 0; i < ARRAY_SIZE(cache->pages); i++)
+		cache->pages[i].address = U32_MAX;
+}
+
+static struct switch2_flash_page *switch2_flash_lookup(struct switch2_flash_cache *cache,
+	uint32_t address)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(cache->pages); i++) {
+		if (cache->pages[i].address == address) {
+			cache->pages[i].used = ++cache->clock;
+			return &cache->pages[i];
+		}
+	}
+	return NULL;
+}
 
-#ifdef CONFIG_SWITCH2_FF
-	input_set_capability(input, EV_FF, FF_RUMBLE);
-	ret = input_ff_create_memless(input, NULL, switch2_play_effect);
-	if (ret) {
-		input_free_device(input);
-		return ret;
+/* Called with the controller lock held */
+static void switch2_flash_read_complete(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, const uint8_t *reply, size_t length)
+{
+	uint8_t size = req->message[0];
+
+	if (req->status)
+		return;
+	if (length < size + 8) {
+		req->status = -EIO;
+		return;
 	}
-#endif
+	memcpy((uint8_t *)req->context, &reply[8], size);
+}
 
-	rcu_assign_pointer(ns2->input, input);
+/* Called with the controller lock held */
+static int switch2_flash_send(struct switch2_controller *ns2, struct switch2_cmd_request *req,
+	unsigned int index, void *context)
+{
+	struct switch2_flash_cache *cache = context;
+	struct switch2_flash_page *page = cache->fill[index / NS2_FLASH_PAGE_READS];
+	uint32_t offset = index % NS2_FLASH_PAGE_READS * NS2_FLASH_CHUNK;
+	uint32_t address = cache->fill_address +
+		index / NS2_FLASH_PAGE_READS * NS2_FLASH_PAGE + offset;
 
-	hid_info(ns2->hdev, "Firmware version %u.%u.%u (%i)\n", ns2->version.major,
-		ns2->version.minor, ns2->version.patch, ns2->version.ctlr_type);
-	if (ns2->version.dsp_type >= 0)
-		hid_info(ns2->hdev, "DSP version %u.%u.%u\n", ns2->version.dsp_major,
-			ns2->version.dsp_minor, ns2->version.dsp_patch);
-	return input_register_device(input);
+	req->complete = switch2_flash_read_complete;
+	req->context = (unsigned long)&page->data[offset];
+	return switch2_read_flash(ns2, req, address,
+		min_t(uint32_t, NS2_FLASH_CHUNK, NS2_FLASH_PAGE - offset));
 }
 
-int switch2_init_controller(struct switch2_controller *ns2)
+/* Must be called with the cache lock held */
+static int switch2_flash_fill(struct switch2_controller *ns2,
+	struct switch2_flash_cache *cache, uint32_t address)
 {
-	if (ns2->init_step == NS2_INIT_DONE)
-		return 0;
+	unsigned int count;
+	unsigned int i;
+	int ret;
 
-	if (!ns2->cfg)
-		return -ENOTCONN;
+	for (count = 0; count < NS2_FLASH_READAHEAD; count++) {
+		struct switch2_flash_page *victim = &cache->pages[0];
+		uint32_t page = address + count * NS2_FLASH_PAGE;
 
-	while (ns2->init_step < NS2_INIT_DONE) {
-		ns2->init_step++;
-		/* TODO verify that the step completed successfully */
-		switch (ns2->init_step) {
-		case NS2_INIT_READ_SERIAL:
-			return switch2_read_flash(ns2, NS2_FLASH_ADDR_SERIAL,
-				NS2_FLASH_SIZE_SERIAL);
-		case NS2_INIT_GET_FIRMWARE_INFO:
-			return ns2->cfg->send_command(NS2_CMD_FW_INFO, NS2_SUBCMD_FW_INFO_GET,
-				NULL, 0, ns2->cfg);
-			break;
-		case NS2_INIT_READ_FACTORY_PRIMARY_CALIB:
-			return switch2_read_flash(ns2, NS2_FLASH_ADDR_FACTORY_PRIMARY_CALIB,
-				NS2_FLASH_SIZE_FACTORY_AXIS_CALIB);
-		case NS2_INIT_READ_FACTORY_SECONDARY_CALIB:
-			if (switch2_ctlr_is_joycon(ns2->ctlr_type))
-				break;
-			return switch2_read_flash(ns2, NS2_FLASH_ADDR_FACTORY_SECONDARY_CALIB,
-				NS2_FLASH_SIZE_FACTORY_AXIS_CALIB);
-		case NS2_INIT_READ_FACTORY_TRIGGER_CALIB:
-			if (ns2->ctlr_type != NS2_CTLR_TYPE_GC)
-				break;
-			return switch2_read_flash(ns2, NS2_FLASH_ADDR_FACTORY_TRIGGER_CALIB,
-				NS2_FLASH_SIZE_FACTORY_TRIGGER_CALIB);
-		case NS2_INIT_READ_USER_PRIMARY_CALIB:
-			return switch2_read_flash(ns2, NS2_FLASH_ADDR_USER_PRIMARY_CALIB,
-				NS2_FLASH_SIZE_USER_AXIS_CALIB);
-		case NS2_INIT_READ_USER_SECONDARY_CALIB:
-			if (switch2_ctlr_is_joycon(ns2->ctlr_type))
-				break;
-			return switch2_read_flash(ns2, NS2_FLASH_ADDR_USER_SECONDARY_CALIB,
-				NS2_FLASH_SIZE_USER_AXIS_CALIB);
-		case NS2_INIT_SET_FEATURE_MASK:
-			return ns2->cfg->send_command(NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_SET_MASK,
-				switch2_feature_mask, sizeof(switch2_feature_mask), ns2->cfg);
-			break;
-		case NS2_INIT_ENABLE_FEATURES:
-			return switch2_features_enable(ns2, NS2_FEATURE_BUTTONS |
-				NS2_FEATURE_ANALOG | NS2_FEATURE_RUMBLE);
-			break;
-#ifdef CONFIG_SWITCH2_FF
-		case NS2_INIT_ENABLE_RUMBLE:
-			return ns2->cfg->send_command(NS2_CMD_NFC, 1,
-				switch2_zero_data, sizeof(switch2_zero_data),
-				ns2->cfg);
+		if (page >= NS2_FLASH_SIZE || (count && switch2_flash_lookup(cache, page)))
 			break;
-#endif
-		case NS2_INIT_GRIP_BUTTONS:
-			if (!switch2_ctlr_is_joycon(ns2->ctlr_type))
-				break;
-			return ns2->cfg->send_command(NS2_CMD_GRIP, NS2_SUBCMD_GRIP_ENABLE_BUTTONS,
-				switch2_one_data, sizeof(switch2_one_data),
-				ns2->cfg);
-			break;
-		case NS2_INIT_SET_PLAYER_LEDS:
-			return switch2_set_player_id(ns2, ns2->player_id);
-		case NS2_INIT_INPUT:
-			return ns2->cfg->send_command(NS2_CMD_INIT, NS2_SUBCMD_INIT_USB,
-				switch2_init_cmd_data, sizeof(switch2_init_cmd_data), ns2->cfg);
-		case NS2_INIT_DONE:
-			if (ns2->hdev)
-				return switch2_init_input(ns2);
-			break;
-		default:
-			WARN_ON_ONCE(1);
+
+		/* Evict the least recently used page */
+		for (i = 1; i < ARRAY_SIZE(cache->pages); i++) {
+			if (cache->pages[i].used < victim->used)
+				victim = &cache->pages[i];
 		}
+		victim->address = U32_MAX;
+		victim->used = ++cache->clock;
+		cache->fill[count] = victim;
 	}
+
+	cache->fill_address = address;
+	ret = switch2_cmd_pipeline(ns2, cache->req, count * NS2_FLASH_PAGE_READS,
+		switch2_flash_send, cache, NULL);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < count; i++)
+		cache->fill[i]->address = address + i * NS2_FLASH_PAGE;
 	return 0;
 }
-EXPORT_SYMBOL_GPL(switch2_init_controller);
 
-static void switch2_report_buttons(struct input_dev *input, const uint8_t *bytes,
-	const struct switch2_ctlr_button_mapping button_mappings[])
+static ssize_t flash_read(struct file *file, struct kobject *kobj,
+	const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
 {
-	const struct switch2_ctlr_button_mapping *button;
+	struct switch2_controller *ns2 = hid_get_drvdata(to_hid_device(kobj_to_dev(kobj)));
+	struct switch2_flash_cache *cache;
+	size_t done = 0;
+	int ret;
+
+	scoped_guard(mutex, &ns2->lock) {
+		if (!(ns2->init_done & BIT(NS2_INIT_DONE)))
+			return -EAGAIN;
+	}
+
+	cache = switch2_flash_get_cache(ns2);
+	if (!cache)
+		return -ENOMEM;
+
+	guard(mutex)(&cache->lock);
+	while (done < count) {
+		uint32_t address = off + done;
+		uint32_t base = round_down(address, NS2_FLASH_PAGE);
+		struct switch2_flash_page *page = switch2_flash_lookup(cache, base);
+		size_t size = min_t(size_t, count - done, base + NS2_FLASH_PAGE - address);
 
-	for (button = button_mappings; button->code; button++)
-		input_report_key(input, button->code, bytes[button->byte] & button->bit);
+		if (!page) {
+			ret = switch2_flash_fill(ns2, cache, base);
+			if (ret)
+				return done ? done : ret;
+			page = switch2_flash_lookup(cache, base);
+		}
+		memcpy(&buf[done], &page->data[address - base], size);
+		done += size;
+	}
+	return done;
 }
+static BIN_ATTR_ADMIN_RO(flash, NS2_FLASH_SIZE);
 
-static void switch2_report_axis(struct input_dev *input, struct switch2_axis_calibration *calib,
-	int axis, int value, bool negate)
+/*
+ * Firmware images are written to flash with several commands in flight,
+ * erase blocks first, then chunks, then read back and compared. Images start
+ * with a struct switch2_fw_header saying where they go, and the rest of the
+ * file is written there as is.
+ */
+static bool flash_write;
+module_param(flash_write, bool, 0644);
+MODULE_PARM_DESC(flash_write,
+	"Allow firmware_update to write to controller flash (default false)");
+
+#define NS2_FW_MAGIC		0x5532534e	/* "NS2U" */
+#define NS2_FLASH_ERASE_SIZE	SZ_4K
+
+/*
+ * Images may only land in the firmware area, between the factory data and
+ * the user area holding the user calibration. The factory block holds the
+ * serial number and calibration, which can't be restored once lost.
+ */
+#define NS2_FW_REGION_START	0x20000
+#define NS2_FW_REGION_END	0x1fc000
+#define NS2_FLASH_FACTORY_START	0x13000
+#define NS2_FLASH_FACTORY_END	0x14000
+
+struct switch2_fw_header {
+	__le32 magic;
+	__le32 address;
+	__le32 size;
+	/* CRC-32 of everything after the header */
+	__le32 crc;
+} __packed;
+
+enum switch2_fw_state {
+	NS2_FW_QUEUED,
+	NS2_FW_ERASING,
+	NS2_FW_WRITING,
+	NS2_FW_VERIFYING,
+	NS2_FW_DONE,
+	NS2_FW_FAILED,
+};
+
+static const char * const switch2_fw_state_names[] = {
+	[NS2_FW_QUEUED] = "queued",
+	[NS2_FW_ERASING] = "erasing",
+	[NS2_FW_WRITING] = "writing",
+	[NS2_FW_VERIFYING] = "verifying",
+	[NS2_FW_DONE] = "done",
+	[NS2_FW_FAILED] = "failed",
+};
+
+struct switch2_fw_update {
+	const struct firmware *fw;
+	const uint8_t *data;
+	uint32_t address;
+	uint32_t size;
+	bool abort;
+
+	enum switch2_fw_state state;
+	/* Commands of @step bytes each done in the current state */
+	unsigned int done;
+	uint32_t step;
+	int error;
+
+	struct switch2_cmd_request req[NS2_PIPELINE_WINDOW];
+};
+
+static void switch2_fw_free(struct switch2_fw_update *fwu)
 {
-	if (calib && calib->neutral && calib->negative && calib->positive) {
-		value -= calib->neutral;
-		value *= NS2_AXIS_MAX + 1;
-		if (value < 0)
-			value /= calib->negative;
-		else
-			value /= calib->positive;
-	} else {
-		value = (value - 2048) * 16;
+	if (!fwu)
+		return;
+	release_firmware(fwu->fw);
+	kfree(fwu);
+}
+
+/* Called with the controller lock held */
+static void switch2_fw_verify_complete(struct switch2_controller *ns2,
+	struct switch2_cmd_request *req, const uint8_t *reply, size_t length)
+{
+	const struct switch2_fw_update *fwu = ns2->fw_update;
+	uint32_t offset = req->context;
+	size_t size = min_t(uint32_t, NS2_FLASH_CHUNK, fwu->size - offset);
+
+	if (req->status)
+		return;
+	if (length < size + 8 || memcmp(&reply[8], &fwu->data[offset], size)) {
+		hid_err(ns2->hdev, "Flash mismatch at %#x\n", fwu->address + offset);
+		req->status = -EIO;
 	}
+}
 
-	if (negate)
-		value = -value;
-	input_report_abs(input, axis,
-		clamp(value, NS2_AXIS_MIN, NS2_AXIS_MAX));
+/* Called with the controller lock held */
+static int switch2_fw_send(struct switch2_controller *ns2, struct switch2_cmd_request *req,
+	unsigned int index, void *context)
+{
+	struct switch2_fw_update *fwu = context;
+	uint8_t message[NS2_CMD_MAX_PAYLOAD] = { 0, 0x7e };
+	uint32_t offset = index * fwu->step;
+	uint32_t address = fwu->address + offset;
+	uint8_t size = min_t(uint32_t, NS2_FLASH_CHUNK, fwu->size - offset);
+
+	lockdep_assert_held(&ns2->lock);
+
+	if (fwu->abort)
+		return -EINTR;
+
+	req->complete = NULL;
+	put_unaligned_le32(address, &message[4]);
+	switch (fwu->state) {
+	case NS2_FW_ERASING:
+		return switch2_cmd_send(ns2, req, NS2_CMD_FLASH, NS2_SUBCMD_FLASH_ERASE_BLOCK,
+			message, 8);
+	case NS2_FW_WRITING:
+		message[0] = size;
+		memcpy(&message[8], &fwu->data[offset], size);
+		return switch2_cmd_send(ns2, req, NS2_CMD_FLASH, NS2_SUBCMD_FLASH_WRITE,
+			message, 8 + size);
+	case NS2_FW_VERIFYING:
+		req->complete = switch2_fw_verify_complete;
+		req->context = offset;
+		return switch2_read_flash(ns2, req, address, size);
+	default:
+		return -EINVAL;
+	}
 }
 
-static void switch2_report_stick(struct input_dev *input, struct switch2_stick_calibration *calib,
-	int x, int y, const uint8_t *data)
+/* One pass over the image in @step sized pieces */
+static int switch2_fw_pass(struct switch2_controller *ns2, struct switch2_fw_update *fwu,
+	enum switch2_fw_state state, uint32_t step)
 {
-	switch2_report_axis(input, &calib->x, x, data[0] | ((data[1] & 0x0F) << 8), false);
-	switch2_report_axis(input, &calib->y, y, (data[1] >> 4) | (data[2] << 4), true);
+	scoped_guard(mutex, &ns2->lock) {
+		fwu->state = state;
+		fwu->step = step;
+		fwu->done = 0;
+	}
+	return switch2_cmd_pipeline(ns2, fwu->req, DIV_ROUND_UP(fwu->size, step),
+		switch2_fw_send, fwu, &fwu->done);
 }
 
-static void switch2_report_trigger(struct input_dev *input, uint8_t zero, int abs, uint8_t data)
+static void switch2_fw_work(struct work_struct *work)
 {
-	int value = (NS2_TRIGGER_RANGE + 1) * (data - zero) / (232 - zero);
+	struct switch2_controller *ns2 = container_of(work, struct switch2_controller,
+		fw_work);
+	struct switch2_fw_update *fwu;
+	ktime_t start = ktime_get();
+	int ret;
 
-	input_report_abs(input, abs, clamp(value, 0, NS2_TRIGGER_RANGE));
+	scoped_guard(mutex, &ns2->lock)
+		fwu = ns2->fw_update;
+
+	ret = switch2_fw_pass(ns2, fwu, NS2_FW_ERASING, NS2_FLASH_ERASE_SIZE);
+	if (!ret)
+		ret = switch2_fw_pass(ns2, fwu, NS2_FW_WRITING, NS2_FLASH_CHUNK);
+	if (!ret)
+		ret = switch2_fw_pass(ns2, fwu, NS2_FW_VERIFYING, NS2_FLASH_CHUNK);
+	/* Whatever was cached from the old contents is stale now */
+	switch2_flash_invalidate(ns2);
+
+	scoped_guard(mutex, &ns2->lock) {
+		/* So is any calibration remembered for it, which the image may have replaced */
+		switch2_calib_cache_forget(ns2->serial);
+		fwu->state = ret ? NS2_FW_FAILED : NS2_FW_DONE;
+		fwu->error = ret;
+		release_firmware(fwu->fw);
+		fwu->fw = NULL;
+		fwu->data = NULL;
+	}
+
+	if (ret)
+		hid_err(ns2->hdev, "Firmware update failed: %d\n", ret);
+	else
+		hid_info(ns2->hdev, "Wrote %u bytes of firmware at %#x in %lld ms\n",
+			fwu->size, fwu->address, ktime_ms_delta(ktime_get(), start));
 }
 
-static int switch2_event(struct hid_device *hdev, struct hid_report *report, uint8_t *raw_data,
-	int size)
+static bool switch2_fw_target_allowed(uint32_t address, uint32_t size)
 {
-	struct switch2_controller *ns2 = hid_get_drvdata(hdev);
-	struct input_dev *input;
+	u64 end = round_up((u64)address + size, NS2_FLASH_ERASE_SIZE);
 
-	if (report->type != HID_INPUT_REPORT)
-		return 0;
+	if (address < NS2_FLASH_FACTORY_END && end > NS2_FLASH_FACTORY_START)
+		return false;
+	return address >= NS2_FW_REGION_START && end <= NS2_FW_REGION_END;
+}
 
-	if (size < 15)
-		return -EINVAL;
+static int switch2_fw_start(struct switch2_controller *ns2, const char *name)
+{
+	const struct switch2_fw_header *header;
+	struct switch2_fw_update *fwu;
+	const struct firmware *fw;
+	int ret;
 
-	rcu_read_lock();
-	input = rcu_dereference(ns2->input);
-	rcu_read_unlock();
+	ret = request_firmware(&fw, name, &ns2->hdev->dev);
+	if (ret)
+		return ret;
 
-	if (!input)
-		return 0;
+	header = (const struct switch2_fw_header *)fw->data;
+	if (fw->size <= sizeof(*header) || le32_to_cpu(header->magic) != NS2_FW_MAGIC ||
+	    le32_to_cpu(header->size) != fw->size - sizeof(*header) ||
+	    !IS_ALIGNED(le32_to_cpu(header->address), NS2_FLASH_ERASE_SIZE)) {
+		hid_err(ns2->hdev, "%s is not a firmware image\n", name);
+		ret = -EINVAL;
+		goto err_release;
+	}
+	if (~crc32_le(~0, &fw->data[sizeof(*header)], fw->size - sizeof(*header)) !=
+	    le32_to_cpu(header->crc)) {
+		hid_err(ns2->hdev, "%s is corrupt\n", name);
+		ret = -EBADMSG;
+		goto err_release;
+	}
+	if (!switch2_fw_target_allowed(le32_to_cpu(header->address),
+				       le32_to_cpu(header->size))) {
+		hid_err(ns2->hdev, "%s targets %#x-%#llx, outside the firmware area\n",
+			name, le32_to_cpu(header->address),
+			(u64)le32_to_cpu(header->address) + le32_to_cpu(header->size) - 1);
+		ret = -EPERM;
+		goto err_release;
+	}
 
-	switch (report->id) {
-	case NS2_REPORT_UNIFIED:
-		/*
-		 * TODO
-		 * This won't be sent unless the report type gets changed via command
-		 * 03-0A, but we should support it at some point regardless.
-		 */
-		break;
-	case NS2_REPORT_JCL:
-		input_report_abs(input, ABS_HAT0X,
-			!!(raw_data[3] & NS2_BTNL_RIGHT) -
-			!!(raw_data[3] & NS2_BTNL_LEFT));
-		input_report_abs(input, ABS_HAT0Y,
-			!!(raw_data[3] & NS2_BTNL_DOWN) -
-			!!(raw_data[3] & NS2_BTNL_UP));
-		switch2_report_stick(input, &ns2->stick_calib[0], ABS_X, ABS_Y, &raw_data[6]);
-		switch2_report_buttons(input, &raw_data[3], left_joycon_button_mappings);
-		break;
-	case NS2_REPORT_JCR:
-		switch2_report_stick(input, &ns2->stick_calib[0], ABS_RX, ABS_RY, &raw_data[6]);
-		switch2_report_buttons(input, &raw_data[3], right_joycon_button_mappings);
-		break;
-	case NS2_REPORT_GC:
-		input_report_abs(input, ABS_HAT0X,
-			!!(raw_data[4] & NS2_BTNL_RIGHT) -
-			!!(raw_data[4] & NS2_BTNL_LEFT));
-		input_report_abs(input, ABS_HAT0Y,
-			!!(raw_data[4] & NS2_BTNL_DOWN) -
-			!!(raw_data[4] & NS2_BTNL_UP));
-		switch2_report_buttons(input, &raw_data[3], gccon_mappings);
-		switch2_report_stick(input, &ns2->stick_calib[0], ABS_X, ABS_Y, &raw_data[6]);
-		switch2_report_stick(input, &ns2->stick_calib[1], ABS_RX, ABS_RY, &raw_data[9]);
-		switch2_report_trigger(input, ns2->lt_zero, ABS_Z, raw_data[13]);
-		switch2_report_trigger(input, ns2->rt_zero, ABS_RZ, raw_data[14]);
-		break;
-	case NS2_REPORT_PRO:
-		input_report_abs(input, ABS_HAT0X,
-			!!(raw_data[4] & NS2_BTNL_RIGHT) -
-			!!(raw_data[4] & NS2_BTNL_LEFT));
-		input_report_abs(input, ABS_HAT0Y,
-			!!(raw_data[4] & NS2_BTNL_DOWN) -
-			!!(raw_data[4] & NS2_BTNL_UP));
-		switch2_report_buttons(input, &raw_data[3], procon_mappings);
-		switch2_report_stick(input, &ns2->stick_calib[0], ABS_X, ABS_Y, &raw_data[6]);
-		switch2_report_stick(input, &ns2->stick_calib[1], ABS_RX, ABS_RY, &raw_data[9]);
-		break;
-	default:
-		return -EINVAL;
+	fwu = kzalloc(sizeof(*fwu), GFP_KERNEL);
+	if (!fwu) {
+		ret = -ENOMEM;
+		goto err_release;
 	}
+	fwu->fw = fw;
+	fwu->data = &fw->data[sizeof(*header)];
+	fwu->address = le32_to_cpu(header->address);
+	fwu->size = le32_to_cpu(header->size);
+	switch2_cmd_init_requests(fwu->req, ARRAY_SIZE(fwu->req));
 
-	input_sync(input);
-	return 0;
+	scoped_guard(mutex, &ns2->lock) {
+		if (!(ns2->init_done & BIT(NS2_INIT_DONE)) || !ns2->cfg) {
+			ret = -EAGAIN;
+		} else if (ns2->fw_update && ns2->fw_update->state < NS2_FW_DONE) {
+			ret = -EBUSY;
+		} else {
+			switch2_fw_free(ns2->fw_update);
+			ns2->fw_update = fwu;
+			queue_work(system_unbound_wq, &ns2->fw_work);
+			return 0;
+		}
+	}
+
+	kfree(fwu);
+err_release:
+	release_firmware(fw);
+	return ret;
+}
+
+/* Stop an update in progress once its commands in flight are done */
+static void switch2_fw_abort(struct switch2_controller *ns2)
+{
+	scoped_guard(mutex, &ns2->lock) {
+		if (ns2->fw_update)
+			WRITE_ONCE(ns2->fw_update->abort, true);
+	}
+	flush_work(&ns2->fw_work);
 }
 
 static int switch2_probe(struct hid_device *hdev, const struct hid_device_id *id)
 {
 	struct switch2_controller *ns2;
 	struct usb_device *udev;
-	char phys[64];
+	char phys[NS2_PHYS_MAX];
 	int ret;
 
 	if (!hid_is_usb(hdev))
@@ -890,8 +4268,8 @@ static int switch2_probe(struct hid_device *hdev, const struct hid_device_id *id
 	}
 
 	ns2 = switch2_get_controller(phys);
-	if (!ns2) {
-		ret = -ENOMEM;
+	if (IS_ERR(ns2)) {
+		ret = PTR_ERR(ns2);
 		goto err_close;
 	}
 
@@ -910,19 +4288,29 @@ static int switch2_probe(struct hid_device *hdev, const struct hid_device_id *id
 		ns2->rumble.hd.lo_freq = RUMBLE_LO_FREQ;
 	}
 	spin_lock_init(&ns2->rumble_lock);
-	INIT_DELAYED_WORK(&ns2->rumble_work, switch2_rumble_work);
+	ns2->rumble_dead = false;
+	ns2->rumble_running = false;
+	hrtimer_setup(&ns2->rumble_timer, switch2_rumble_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL_SOFT);
+	INIT_WORK(&ns2->rumble_work, switch2_rumble_work);
+	ret = switch2_alloc_rumble(ns2);
+	if (ret)
+		goto err_put;
 #endif
 	hid_set_drvdata(hdev, ns2);
-
-	if (ns2->cfg) {
-		ret = switch2_init_controller(ns2);
-		mutex_unlock(&ns2->lock);
-		return ret;
-	}
-
 	mutex_unlock(&ns2->lock);
+
+	switch2_schedule_init(ns2);
 	return 0;
 
+#ifdef CONFIG_SWITCH2_FF
+err_put:
+	ns2->hdev = NULL;
+	mutex_unlock(&ns2->lock);
+	if (ns2->player_id != U32_MAX)
+		ida_free(&switch2_player_id_allocator, ns2->player_id);
+	switch2_controller_put(ns2);
+#endif
 err_close:
 	hid_hw_close(hdev);
 err_stop:
@@ -934,14 +4322,15 @@ err_stop:
 static void switch2_remove(struct hid_device *hdev)
 {
 	struct switch2_controller *ns2 = hid_get_drvdata(hdev);
-#ifdef CONFIG_SWITCH2_FF
-	unsigned long flags;
-#endif
 
+	switch2_fw_abort(ns2);
 #ifdef CONFIG_SWITCH2_FF
-	spin_lock_irqsave(&ns2->rumble_lock, flags);
-	cancel_delayed_work_sync(&ns2->rumble_work);
-	spin_unlock_irqrestore(&ns2->rumble_lock, flags);
+	/* The input device outlives this, and stopping its effects calls playback */
+	scoped_guard(spinlock_irqsave, &ns2->rumble_lock)
+		ns2->rumble_dead = true;
+	hrtimer_cancel(&ns2->rumble_timer);
+	cancel_work_sync(&ns2->rumble_work);
+	switch2_free_rumble(ns2);
 #endif
 	mutex_lock(&ns2->lock);
 	ns2->hdev = NULL;
@@ -952,6 +4341,171 @@ static void switch2_remove(struct hid_device *hdev)
 	hid_hw_stop(hdev);
 }
 
+#ifdef CONFIG_PM
+static int switch2_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct switch2_controller *ns2 = hid_get_drvdata(hdev);
+
+	/* Don't leave a half-written image behind */
+	scoped_guard(mutex, &ns2->lock) {
+		if (ns2->fw_update && ns2->fw_update->state < NS2_FW_DONE)
+			return -EBUSY;
+	}
+
+	switch2_controller_suspend(ns2, NS2_PM_HID);
+#ifdef CONFIG_SWITCH2_FF
+	switch2_park_rumble(ns2);
+#endif
+	return 0;
+}
+
+/*
+ * A reset loses nothing that a plain suspend doesn't: either way the controller
+ * has forgotten its state, and the steps that set it are sent again.
+ */
+static int switch2_resume(struct hid_device *hdev)
+{
+	switch2_controller_resume(hid_get_drvdata(hdev), NS2_PM_HID);
+	return 0;
+}
+#endif
+
+/*
+ * Change which features a running controller reports, without another init.
+ * The mask goes first so the controller accepts what is enabled after it.
+ * Motion data is only carried by the unified report, so turning on the IMU
+ * also switches to that report and creates the IMU device if needed. The
+ * whole exchange runs under features_lock, so two writers can't interleave
+ * their commands and leave the controller with a mix of both.
+ */
+static int switch2_set_features(struct switch2_controller *ns2, uint32_t new)
+{
+	__le32 feature_bits = __cpu_to_le32(new);
+	uint32_t old;
+	int ret;
+
+	guard(mutex)(&ns2->features_lock);
+	scoped_guard(mutex, &ns2->lock) {
+		old = ns2->features;
+		/* Init picks up the new value for whatever it hasn't sent yet */
+		if (!(ns2->init_done & BIT(NS2_INIT_DONE))) {
+			WRITE_ONCE(ns2->features, new);
+			return 0;
+		}
+	}
+
+	if (new == old)
+		return 0;
+
+	ret = switch2_cmd_sync(ns2, NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_SET_MASK,
+		&feature_bits, sizeof(feature_bits));
+	if (!ret && (old & ~new)) {
+		feature_bits = __cpu_to_le32(old & ~new);
+		ret = switch2_cmd_sync(ns2, NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_DISABLE,
+			&feature_bits, sizeof(feature_bits));
+	}
+	if (!ret && (new & ~old)) {
+		feature_bits = __cpu_to_le32(new & ~old);
+		ret = switch2_cmd_sync(ns2, NS2_CMD_FEATSEL, NS2_SUBCMD_FEATSEL_ENABLE,
+			&feature_bits, sizeof(feature_bits));
+	}
+	if (!ret && !(old & NS2_FEATURES_UNIFIED) && (new & NS2_FEATURES_UNIFIED) &&
+	    !unified_report)
+		ret = switch2_cmd_sync(ns2, NS2_CMD_INIT, NS2_SUBCMD_INIT_SELECT_REPORT,
+			switch2_unified_report_data, sizeof(switch2_unified_report_data));
+	if (ret)
+		return ret;
+
+	guard(mutex)(&ns2->lock);
+	WRITE_ONCE(ns2->features, new);
+	if ((new & NS2_FEATURE_IMU) && ns2->hdev && !rcu_access_pointer(ns2->imu)) {
+		ret = switch2_init_imu(ns2);
+		if (ret)
+			return ret;
+	}
+	if ((new & NS2_FEATURE_MOUSE) && ns2->hdev && !rcu_access_pointer(ns2->mouse))
+		return switch2_init_mouse(ns2);
+	return 0;
+}
+
+static ssize_t firmware_update_show(struct device *dev, struct device_attribute *attr,
+	char *buf)
+{
+	struct switch2_controller *ns2 = hid_get_drvdata(to_hid_device(dev));
+	const struct switch2_fw_update *fwu;
+
+	guard(mutex)(&ns2->lock);
+	fwu = ns2->fw_update;
+	if (!fwu)
+		return sysfs_emit(buf, "idle\n");
+	if (fwu->state == NS2_FW_FAILED)
+		return sysfs_emit(buf, "%s %d\n", switch2_fw_state_names[fwu->state], fwu->error);
+	return sysfs_emit(buf, "%s %u/%u\n", switch2_fw_state_names[fwu->state],
+		(uint32_t)min_t(u64, (u64)READ_ONCE(fwu->done) * fwu->step, fwu->size),
+		fwu->size);
+}
+
+static ssize_t firmware_update_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct switch2_controller *ns2 = hid_get_drvdata(to_hid_device(dev));
+	char *name;
+	int ret;
+
+	if (!flash_write)
+		return -EPERM;
+
+	name = kstrndup(buf, count, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	ret = switch2_fw_start(ns2, strim(name));
+	kfree(name);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(firmware_update);
+
+static ssize_t features_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct switch2_controller *ns2 = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "0x%02x\n", READ_ONCE(ns2->features));
+}
+
+static ssize_t features_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct switch2_controller *ns2 = hid_get_drvdata(to_hid_device(dev));
+	unsigned int value;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &value);
+	if (ret)
+		return ret;
+	if (value & ~NS2_FEATURES_ALL)
+		return -EINVAL;
+
+	ret = switch2_set_features(ns2, value);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(features);
+
+static struct attribute *switch2_attrs[] = {
+	&dev_attr_features.attr,
+	&dev_attr_firmware_update.attr,
+	NULL,
+};
+static const struct bin_attribute *const switch2_bin_attrs[] = {
+	&bin_attr_flash,
+	NULL,
+};
+
+static const struct attribute_group switch2_group = {
+	.attrs = switch2_attrs,
+	.bin_attrs = switch2_bin_attrs,
+};
+__ATTRIBUTE_GROUPS(switch2);
+
 static const struct hid_device_id switch2_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_NINTENDO, USB_DEVICE_ID_NINTENDO_NS2_JOYCONL) },
 	{ HID_USB_DEVICE(USB_VENDOR_ID_NINTENDO, USB_DEVICE_ID_NINTENDO_NS2_JOYCONR) },
@@ -967,17 +4521,66 @@ static struct hid_driver switch2_hid_driver = {
 	.probe		= switch2_probe,
 	.remove		= switch2_remove,
 	.raw_event	= switch2_event,
+#ifdef CONFIG_PM
+	.suspend	= switch2_suspend,
+	.resume		= switch2_resume,
+	.reset_resume	= switch2_resume,
+#endif
+	.driver = {
+		.dev_groups = switch2_groups,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
 
 static int __init switch2_init(void)
 {
-	return hid_register_driver(&switch2_hid_driver);
+	int ret;
+
+	switch2_controller_cache = KMEM_CACHE(switch2_controller, SLAB_HWCACHE_ALIGN);
+	if (!switch2_controller_cache)
+		return -ENOMEM;
+
+	switch2_wq = alloc_workqueue("switch2", WQ_HIGHPRI, 0);
+	if (!switch2_wq) {
+		kmem_cache_destroy(switch2_controller_cache);
+		return -ENOMEM;
+	}
+
+	switch2_debugfs_root = debugfs_create_dir("hid-switch2", NULL);
+	debugfs_create_file("replay", 0600, switch2_debugfs_root, NULL,
+		&switch2_replay_fops);
+	debugfs_create_u32("replay_controllers", 0600, switch2_debugfs_root,
+		&switch2_replay_controllers);
+	debugfs_create_u32("replay_loops", 0600, switch2_debugfs_root,
+		&switch2_replay_loops);
+	debugfs_create_bool("replay_sweep", 0600, switch2_debugfs_root,
+		&switch2_replay_sweep);
+
+	ret = hid_register_driver(&switch2_hid_driver);
+	if (ret) {
+		debugfs_remove_recursive(switch2_debugfs_root);
+		destroy_workqueue(switch2_wq);
+		kmem_cache_destroy(switch2_controller_cache);
+	}
+	return ret;
 }
 
 static void __exit switch2_exit(void)
 {
 	hid_unregister_driver(&switch2_hid_driver);
+	debugfs_remove_recursive(switch2_debugfs_root);
+	destroy_workqueue(switch2_wq);
 	ida_destroy(&switch2_player_id_allocator);
+	ida_destroy(&switch2_raw_ida);
+	ida_destroy(&switch2_pair_ida);
+
+	mutex_lock(&switch2_calib_cache_lock);
+	switch2_calib_cache_trim(0);
+	mutex_unlock(&switch2_calib_cache_lock);
+
+	/* Controllers released last are still waiting for their grace period */
+	rcu_barrier();
+	kmem_cache_destroy(switch2_controller_cache);
 }
 
 module_init(switch2_init);
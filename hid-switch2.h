@@ -10,10 +10,17 @@
  */
 
 #include <linux/bits.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
 #include <linux/input.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/list_bl.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include "hid-ids.h"
 
 #define NS2_FLAG_OK	BIT(0)
@@ -31,6 +38,10 @@
 #define NS2_FLASH_SIZE_FACTORY_TRIGGER_CALIB 2
 #define NS2_FLASH_SIZE_USER_AXIS_CALIB 11
 
+/* A read reply carries the command header and an 8-byte size/address echo */
+#define NS2_FLASH_READ_REPLY_OVERHEAD 16
+#define NS2_FLASH_READ_MAX U8_MAX
+
 #define NS2_USER_CALIB_MAGIC 0xa1b2
 
 #define NS2_FEATURE_BUTTONS	BIT(0)
@@ -39,6 +50,8 @@
 #define NS2_FEATURE_MOUSE	BIT(4)
 #define NS2_FEATURE_RUMBLE	BIT(5)
 #define NS2_FEATURE_MAGNETO	BIT(7)
+#define NS2_FEATURES_ALL	(NS2_FEATURE_BUTTONS | NS2_FEATURE_ANALOG | \
+	NS2_FEATURE_IMU | NS2_FEATURE_MOUSE | NS2_FEATURE_RUMBLE | NS2_FEATURE_MAGNETO)
 
 enum switch2_cmd {
 	NS2_CMD_NFC = 0x01,
@@ -137,9 +150,11 @@ enum switch2_init_step {
 #endif
 	NS2_INIT_GRIP_BUTTONS,
 	NS2_INIT_SET_PLAYER_LEDS,
+	NS2_INIT_SELECT_REPORT,
 	NS2_INIT_INPUT,
 	NS2_INIT_DONE,
 };
+static_assert(NS2_INIT_DONE < BITS_PER_LONG);
 
 struct switch2_cmd_header {
 	uint8_t command;
@@ -153,9 +168,44 @@ struct switch2_cmd_header {
 static_assert(sizeof(struct switch2_cmd_header) == 8);
 
 struct switch2_controller;
+
+#define NS2_CMD_MAX_PAYLOAD 56
+
+/*
+ * A command whose response we wait for. Responses are matched by command and
+ * subcommand, and for flash reads by address too. A request that is NACKed or
+ * times out is resent a few times before it completes with an error.
+ */
+struct switch2_cmd_request {
+	struct list_head entry;
+	enum switch2_cmd command;
+	uint8_t subcommand;
+	uint32_t address;
+	uint8_t message[NS2_CMD_MAX_PAYLOAD];
+	size_t length;
+	unsigned int attempts;
+	unsigned long deadline;
+	/* When the request was first sent, and when it was last (re)sent */
+	ktime_t queued;
+	ktime_t sent;
+	int status;
+
+	/* Called with the controller lock held, unless the request was cancelled */
+	void (*complete)(struct switch2_controller *controller,
+		struct switch2_cmd_request *request,
+		const uint8_t *reply, size_t length);
+	struct completion done;
+	unsigned long context;
+};
+
 struct switch2_cfg_intf {
 	struct switch2_controller *parent;
 
+	/* How many commands may be outstanding at once; 0 means one */
+	unsigned int queue_depth;
+	/* Largest reply the transport can receive; 0 if unbounded */
+	size_t max_reply;
+
 	int (*send_command)(enum switch2_cmd command, uint8_t subcommand,
 		const void *message, size_t length,
 		struct switch2_cfg_intf *intf);
@@ -177,6 +227,13 @@ struct switch2_axis_calibration {
 	uint16_t neutral;
 	uint16_t negative;
 	uint16_t positive;
+
+	/* Derived from the above by switch2_prepare_axis_calibration() */
+	uint16_t center;
+	uint8_t negative_shift;
+	uint8_t positive_shift;
+	uint32_t negative_scale;
+	uint32_t positive_scale;
 };
 
 struct switch2_stick_calibration {
@@ -184,6 +241,16 @@ struct switch2_stick_calibration {
 	struct switch2_axis_calibration y;
 };
 
+/* What the input path needs from calibration, replaced as a whole on update */
+struct switch2_calibration {
+	struct switch2_stick_calibration stick[2];
+	uint8_t lt_zero;
+	uint8_t rt_zero;
+	/* Bumped on every update, starting from 1 */
+	unsigned int generation;
+	struct rcu_head rcu;
+};
+
 struct switch2_hd_rumble {
 	uint16_t hi_freq : 10;
 	uint16_t hi_amp : 10;
@@ -196,35 +263,218 @@ struct switch2_erm_rumble {
 	uint16_t amplitude;
 };
 
+#define NS2_STATS_REPORT_IDS 16
+#define NS2_STATS_RTT_BUCKETS 16
+
+/*
+ * Per-CPU event counters, summed when read through debugfs. Bucket n of the
+ * round-trip histogram counts responses that took less than 2^n microseconds
+ * and at least half that; the last bucket also takes everything slower.
+ */
+struct switch2_stats {
+	u64 reports[NS2_STATS_REPORT_IDS];
+	u64 reports_deduped;
+	u64 bulk_in_submit_failed;
+	u64 out_queue_full;
+	u64 rumble_ticks;
+	u64 rumble_missed;
+	u64 cmd_retries;
+	u64 cmd_timeouts;
+	u64 cmd_rtt[NS2_STATS_RTT_BUCKETS];
+};
+
+#define switch2_stat_inc(ns2, field) this_cpu_inc((ns2)->stats->field)
+#define switch2_stat_add(ns2, field, n) this_cpu_add((ns2)->stats->field, n)
+
+#define NS2_RUMBLE_SIZE 64
+#define NS2_RUMBLE_FRAMES 2
+
+#define NS2_FF_EFFECTS 16
+/* HD rumble samples each LRA block of an output report can carry */
+#define NS2_HD_SAMPLES_PER_FRAME 3
+#define NS2_WAVEFORM_RING 128
+#define NS2_WAVEFORM_MAX_SAMPLES NS2_WAVEFORM_RING
+
+/* An uploaded force feedback effect */
+struct switch2_ff_effect {
+	/* FF_RUMBLE */
+	uint16_t strong;
+	uint16_t weak;
+	uint16_t length;
+	/* FF_PERIODIC with an FF_CUSTOM waveform */
+	unsigned int samples;
+	struct switch2_hd_rumble *waveform;
+};
+
+/* A preallocated rumble output report and the URB that carries it */
+struct switch2_rumble_frame {
+	struct switch2_controller *parent;
+	struct urb *urb;
+	uint8_t *data;
+	uint8_t seq;
+	bool busy;
+};
+
+/*
+ * Layout of the raw report ring mapped from /dev/switch2-rawN. The header takes
+ * the first page and the entries follow it. head counts every report ever
+ * written; entry i lives at i % entries. The kernel sets an entry's seq to i
+ * only once the entry is complete, so a reader that sees the same seq before
+ * and after copying it out knows it wasn't overwritten in the meantime.
+ */
+#define NS2_RAW_RING_VERSION 1
+#define NS2_RAW_REPORT_SIZE 64
+
+struct switch2_raw_ring_header {
+	__u32 version;
+	__u32 entries;
+	__u32 entry_size;
+	__u32 reserved;
+	__u64 head;
+};
+
+struct switch2_raw_entry {
+	__u64 seq;
+	__u64 timestamp_ns;
+	__u8 report_id;
+	__u8 reserved;
+	__u16 size;
+	__u8 data[NS2_RAW_REPORT_SIZE];
+};
+
+struct switch2_raw_ring;
+struct switch2_pair;
+struct switch2_fw_update;
+struct switch2_flash_cache;
+
+/* Longest USB path a controller is looked up by */
+#define NS2_PHYS_MAX 64
+
+/*
+ * Everything the input path touches for each report comes first, so that a
+ * report reads and dirties only the first two cache lines. The command and
+ * init state after it is written from other CPUs and starts on a line of its
+ * own, so those writes don't bounce the hot lines around.
+ */
 struct switch2_controller {
-	struct hid_device *hdev;
+	struct input_dev __rcu *input;
+	/* Motion sensors, only present when the IMU is enabled */
+	struct input_dev __rcu *imu;
+	/* Optical sensor as a pointer, only present in mouse mode on a Joy-Con */
+	struct input_dev __rcu *mouse;
+	struct switch2_calibration __rcu *calib;
+	struct switch2_raw_ring __rcu *raw;
+	struct switch2_pair __rcu *pair;
+	struct switch2_stats __percpu *stats;
+	enum switch2_ctlr_type ctlr_type;
+	/* NS2_FEATURE_* bits enabled on the controller, read locklessly by the input path */
+	uint32_t features;
+
+	/* Raw stick and trigger bytes of the last input report, and its calibration */
+	uint64_t last_axes;
+	unsigned int last_calib_gen;
+	/* Packed button bytes of the last input report */
+	uint32_t last_buttons;
+	/* Input reports received, for tracing */
+	uint32_t report_seq;
+	/*
+	 * Mouse mode: the optical sensor's counters in the last report, and what
+	 * scaling left over of a count (in 1/256) and of a high-resolution wheel
+	 * unit (in 1/32768), plus wheel units that don't make up a notch yet.
+	 * X comes first in each pair.
+	 */
+	uint16_t mouse_last[2];
+	bool mouse_synced;
+	int32_t mouse_rem[2];
+	int32_t wheel_rem[2];
+	int32_t wheel_hi_res[2];
+
+	struct hid_device *hdev ____cacheline_aligned;
 	struct switch2_cfg_intf *cfg;
 
-	char phys[64];
-	struct list_head entry;
+	/* Allocated to fit, at most NS2_PHYS_MAX - 1 characters */
+	const char *phys;
+	u32 phys_hash;
+	struct hlist_bl_node node;
+	struct kref ref;
+	struct rcu_head rcu;
 	struct mutex lock;
-
-	enum switch2_ctlr_type ctlr_type;
-	enum switch2_init_step init_step;
-	struct input_dev __rcu *input;
+	/* Serialises writes to features, which send commands without holding lock */
+	struct mutex features_lock;
+
+	/* Bitmaps of enum switch2_init_step */
+	unsigned long init_sent;
+	unsigned long init_done;
+	unsigned int init_inflight;
+	struct switch2_cmd_request init_requests[NS2_INIT_DONE];
+	/* How long each init step and the whole sequence took, for debugfs */
+	ktime_t init_start;
+	u32 init_step_us[NS2_INIT_DONE];
+	u32 init_us;
+	/* Bitmap of NS2_PM_* interfaces that are currently suspended */
+	unsigned int suspended;
+
+	/*
+	 * Requests waiting for a response, oldest first. Changes need cmd_lock as
+	 * well as the controller lock, so that responses can be matched from the
+	 * transport's completion handler.
+	 */
+	struct list_head cmd_pending;
+	spinlock_t cmd_lock;
+	struct delayed_work cmd_timeout_work;
+	/* Runs the init sequence and input registration off the probe path */
+	struct work_struct init_work;
+	/* The last firmware update, kept around so its outcome can be read */
+	struct switch2_fw_update *fw_update;
+	struct work_struct fw_work;
+	/* Pages read through the flash attribute, allocated on first use */
+	struct switch2_flash_cache *flash_cache;
 	char serial[NS2_FLASH_SIZE_SERIAL + 1];
 	struct switch2_version_info version;
 
+	/*
+	 * Calibration as parsed, written under lock. Readers in the input path
+	 * only see the published copy, so they never see a partial update.
+	 */
 	struct switch2_stick_calibration stick_calib[2];
 	uint8_t lt_zero;
 	uint8_t rt_zero;
 
 	uint32_t player_id;
+	struct dentry *debugfs;
 
 #ifdef CONFIG_SWITCH2_FF
 	spinlock_t rumble_lock;
+	/* Set under rumble_lock once the HID interface goes; nothing may rearm the timer */
+	bool rumble_dead;
+	/*
+	 * Set under rumble_lock while the timer is armed or about to be, and
+	 * cleared by the timer under the same lock once it decides to stop.
+	 * hrtimer_active() is still true while that last callback unwinds.
+	 */
+	bool rumble_running;
 	uint8_t rumble_seq;
 	union {
 		struct switch2_hd_rumble hd;
 		struct switch2_erm_rumble sd;
 	} rumble;
-	unsigned long last_rumble_work;
-	struct delayed_work rumble_work;
+	struct hrtimer rumble_timer;
+	/* Scheduler periods not yet covered by a frame */
+	unsigned int rumble_ticks;
+	struct work_struct rumble_work;
+	struct switch2_rumble_frame rumble_frames[NS2_RUMBLE_FRAMES];
+	unsigned int rumble_next;
+	/* When the playing FF_RUMBLE effect ends, 0 if it plays until stopped */
+	ktime_t rumble_end;
+	struct switch2_ff_effect ff_effects[NS2_FF_EFFECTS];
+	/*
+	 * Custom waveform samples waiting to be sent, one per rumble period, in a
+	 * ring of NS2_WAVEFORM_RING. GameCube controllers have no HD rumble and
+	 * don't get one.
+	 */
+	struct switch2_hd_rumble *waveform;
+	unsigned int waveform_head;
+	unsigned int waveform_tail;
 #endif
 };
 
@@ -233,10 +483,46 @@ void switch2_controller_put(struct switch2_controller *controller);
 
 int switch2_receive_command(struct switch2_controller *controller,
 	const uint8_t *message, size_t length);
+bool switch2_receive_command_atomic(struct switch2_controller *controller,
+	const uint8_t *message, size_t length);
 
 int switch2_init_controller(struct switch2_controller *controller);
+void switch2_schedule_init(struct switch2_controller *controller);
+
+/* Which interface a suspend or resume comes from */
+#define NS2_PM_HID	BIT(0)
+#define NS2_PM_CFG	BIT(1)
+
+void switch2_controller_suspend(struct switch2_controller *controller,
+	unsigned int interface);
+void switch2_controller_resume(struct switch2_controller *controller,
+	unsigned int interface);
+
+bool switch2_queue_work(struct work_struct *work);
 
 static inline bool switch2_ctlr_is_joycon(enum switch2_ctlr_type type)
 {
 	return type == NS2_CTLR_TYPE_JCL || type == NS2_CTLR_TYPE_JCR;
 }
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* Exported to hid-switch2-test.ko only, see hid-switch2-test.c */
+struct switch2_pair;
+
+int switch2_decode(struct switch2_controller *ns2, struct input_dev *input,
+	struct input_dev *imu, struct input_dev *mouse, struct switch2_pair *pair,
+	const struct switch2_calibration *calib, uint8_t id,
+	const uint8_t *raw_data, int size);
+int switch2_config_input(struct input_dev *input, enum switch2_ctlr_type type);
+void switch2_prepare_axis_range(uint16_t range, uint32_t *scale, uint8_t *shift);
+void switch2_prepare_stick_calibration(struct switch2_stick_calibration *calib);
+bool switch2_parse_stick_calibration(struct switch2_stick_calibration *calib,
+	const uint8_t *data);
+unsigned long switch2_init_plan_flash_read(struct switch2_controller *ns2,
+	enum switch2_init_step step, uint32_t *address, uint8_t *size);
+#ifdef CONFIG_SWITCH2_FF
+void switch2_encode_rumble(const struct switch2_hd_rumble *rumble, uint8_t buffer[5]);
+bool switch2_fill_rumble(struct switch2_controller *ns2, uint8_t *buffer,
+	unsigned int ticks);
+#endif
+#endif
@@ -10,182 +10,402 @@
  */
 
 #include "hid-switch2.h"
+#include "hid-switch2-trace.h"
 #include <linux/module.h>
 #include <linux/usb/input.h>
 
 #define NS2_BULK_SIZE 64
-#define NS2_IN_URBS 2
+/*
+ * Responses can span several packets. Make room for the longest flash read,
+ * so that init can fetch neighbouring calibration blocks in one command.
+ */
+#define NS2_BULK_IN_SIZE ALIGN(NS2_FLASH_READ_REPLY_OVERHEAD + NS2_FLASH_READ_MAX, \
+	NS2_BULK_SIZE)
+#define NS2_IN_URBS_MAX 16
 #define NS2_OUT_URBS 4
+static_assert(NS2_OUT_URBS <= BITS_PER_LONG);
 
 static struct usb_driver switch2_usb;
 
+static unsigned int in_urbs = 4;
+module_param(in_urbs, uint, 0444);
+MODULE_PARM_DESC(in_urbs, "Number of bulk-in URBs kept listening for responses (2-16, default 4)");
+
+#define NS2_OUT_QUEUE_LEN 16
+
 struct switch2_urb {
 	struct urb *urb;
 	uint8_t *data;
-	bool active;
+	/* Bulk-in only: sequence number of the last completion, for tracing */
+	u32 seq;
+};
+
+struct switch2_out_msg {
+	uint8_t length;
+	uint8_t data[NS2_BULK_SIZE];
 };
 
 struct switch2_usb {
 	struct switch2_cfg_intf cfg;
 	struct usb_device *udev;
+	bool disconnected;
 
-	struct switch2_urb bulk_in[NS2_IN_URBS];
+	struct switch2_urb *bulk_in;
+	unsigned int bulk_in_count;
 	struct usb_anchor bulk_in_anchor;
-	spinlock_t bulk_in_lock;
+	/* Bitmap of bulk-in URBs that are neither submitted nor queued */
+	unsigned long bulk_in_idle;
+	u32 bulk_in_seq;
 
 	struct switch2_urb bulk_out[NS2_OUT_URBS];
+	/* Bitmap of bulk-out URBs that are in flight */
+	unsigned long bulk_out_busy;
 	struct usb_anchor bulk_out_anchor;
+	/* Protects the queue below and serialises submission */
 	spinlock_t bulk_out_lock;
-
-	int message_in;
+	struct switch2_out_msg out_queue[NS2_OUT_QUEUE_LEN];
+	unsigned int out_queue_head;
+	unsigned int out_queue_count;
+
+	/*
+	 * Completed bulk-in URBs waiting for the worker, oldest first. The
+	 * completion handler is the only producer, since the HCD gives back
+	 * URBs for one endpoint one at a time, and message_in_work is the only
+	 * consumer, so the ring needs no lock. Every URB is in the ring at most
+	 * once, so it can't overflow.
+	 */
+	uint8_t *message_in;
+	unsigned int message_in_mask;
+	unsigned int message_in_head;
+	unsigned int message_in_tail;
 	struct work_struct message_in_work;
 };
 
+static int switch2_usb_submit_in(struct switch2_usb *ns2_usb, unsigned int i, gfp_t gfp)
+{
+	struct switch2_urb *ns2_urb = &ns2_usb->bulk_in[i];
+	int err;
+
+	usb_anchor_urb(ns2_urb->urb, &ns2_usb->bulk_in_anchor);
+	err = usb_submit_urb(ns2_urb->urb, gfp);
+	if (err) {
+		usb_unanchor_urb(ns2_urb->urb);
+		set_bit(i, &ns2_usb->bulk_in_idle);
+		switch2_stat_inc(ns2_usb->cfg.parent, bulk_in_submit_failed);
+		dev_dbg(&ns2_usb->udev->dev, "failed to queue input urb: %d\n", err);
+	}
+	return err;
+}
+
+/*
+ * A transfer only ends on a short packet, so a reply that exactly fills its
+ * last packet runs on into whatever the controller sends next. Returns the
+ * length of the first reply in @data. A glued reply must end on a packet
+ * boundary, which keeps a bogus length byte from splitting a lone reply.
+ */
+static size_t switch2_usb_message_len(const uint8_t *data, size_t length)
+{
+	const struct switch2_cmd_header *header = (const struct switch2_cmd_header *)data;
+	size_t len;
+
+	if (length < sizeof(*header))
+		return length;
+	len = sizeof(*header) + header->length;
+	if (len >= length || len % NS2_BULK_SIZE)
+		return length;
+	return len;
+}
+
 static void switch2_bulk_in(struct urb *urb)
 {
 	struct switch2_usb *ns2_usb = urb->context;
-	int i;
-	bool schedule = false;
-	unsigned long flags;
+	unsigned int tail;
+	unsigned int i;
+
+	for (i = 0; i < ns2_usb->bulk_in_count; i++)
+		if (ns2_usb->bulk_in[i].urb == urb)
+			break;
+	if (WARN_ON_ONCE(i == ns2_usb->bulk_in_count))
+		return;
+
+	ns2_usb->bulk_in[i].seq = ++ns2_usb->bulk_in_seq;
+	trace_switch2_bulk_in(ns2_usb->cfg.parent->phys, ns2_usb->bulk_in[i].seq,
+		urb->status, urb->actual_length);
 
 	switch (urb->status) {
 	case 0:
-		schedule = true;
 		break;
 	case -ECONNRESET:
 	case -ENOENT:
 	case -ESHUTDOWN:
+		set_bit(i, &ns2_usb->bulk_in_idle);
 		return;
 	default:
 		dev_dbg(&ns2_usb->udev->dev, "unknown urb status: %d\n",
 			urb->status);
-		break;
+		/* Let the worker resubmit it */
+		set_bit(i, &ns2_usb->bulk_in_idle);
+		goto out;
 	}
 
-	spin_lock_irqsave(&ns2_usb->bulk_in_lock, flags);
-	for (i = 0; i < NS2_IN_URBS; i++) {
-		int err;
-		struct switch2_urb *ns2_urb;
+	/*
+	 * Plain ACKs are done with right here, without a trip through the worker.
+	 * Glued replies go to the worker, which splits them.
+	 */
+	if (switch2_usb_message_len(urb->transfer_buffer, urb->actual_length) ==
+			urb->actual_length &&
+	    switch2_receive_command_atomic(ns2_usb->cfg.parent, urb->transfer_buffer,
+			urb->actual_length)) {
+		if (READ_ONCE(ns2_usb->disconnected) ||
+		    !switch2_usb_submit_in(ns2_usb, i, GFP_ATOMIC))
+			return;
+		/* The worker retries failed submissions */
+		goto out;
+	}
 
-		if (ns2_usb->bulk_in[i].urb == urb) {
-			ns2_usb->message_in = i;
-			continue;
-		}
+	tail = ns2_usb->message_in_tail;
+	ns2_usb->message_in[tail & ns2_usb->message_in_mask] = i;
+	smp_store_release(&ns2_usb->message_in_tail, tail + 1);
 
-		if (ns2_usb->bulk_in[i].active)
-			continue;
+out:
+	if (!READ_ONCE(ns2_usb->disconnected))
+		switch2_queue_work(&ns2_usb->message_in_work);
+}
 
-		ns2_urb = &ns2_usb->bulk_in[i];
-		usb_anchor_urb(ns2_urb->urb, &ns2_usb->bulk_out_anchor);
-		err = usb_submit_urb(ns2_urb->urb, GFP_ATOMIC);
-		if (err) {
-			usb_unanchor_urb(ns2_urb->urb);
-			dev_dbg(&ns2_usb->udev->dev, "failed to queue input urb: %d\n", err);
-		} else {
-			ns2_urb->active = true;
-		}
+/* Must be called with bulk_out_lock held and slot @i claimed in bulk_out_busy */
+static int switch2_usb_submit_out(struct switch2_usb *ns2_usb, unsigned int i,
+	const uint8_t *data, size_t length)
+{
+	struct switch2_urb *urb = &ns2_usb->bulk_out[i];
+	int ret;
+
+	memcpy(urb->data, data, length);
+	urb->urb->transfer_buffer_length = length;
+
+	print_hex_dump_debug("sending cmd: ", DUMP_PREFIX_OFFSET, 16, 1, urb->data,
+		length, false);
+
+	usb_anchor_urb(urb->urb, &ns2_usb->bulk_out_anchor);
+	ret = usb_submit_urb(urb->urb, GFP_ATOMIC);
+	if (ret) {
+		dev_warn(&ns2_usb->udev->dev, "failed to submit urb: %i", ret);
+		usb_unanchor_urb(urb->urb);
+		clear_bit(i, &ns2_usb->bulk_out_busy);
 	}
-	spin_unlock_irqrestore(&ns2_usb->bulk_in_lock, flags);
+	return ret;
+}
 
-	if (schedule)
-		schedule_work(&ns2_usb->message_in_work);
+/*
+ * Must be called with bulk_out_lock held. Hands the URB in slot @i the next
+ * queued command, or frees the slot if nothing is waiting.
+ */
+static void switch2_usb_drain_out(struct switch2_usb *ns2_usb, unsigned int i)
+{
+	while (ns2_usb->out_queue_count) {
+		struct switch2_out_msg *msg = &ns2_usb->out_queue[ns2_usb->out_queue_head];
+
+		ns2_usb->out_queue_head = (ns2_usb->out_queue_head + 1) % NS2_OUT_QUEUE_LEN;
+		ns2_usb->out_queue_count--;
+		if (!switch2_usb_submit_out(ns2_usb, i, msg->data, msg->length))
+			return;
+		/* The slot was released on failure; try to take it back */
+		if (test_and_set_bit(i, &ns2_usb->bulk_out_busy))
+			return;
+	}
+	clear_bit(i, &ns2_usb->bulk_out_busy);
 }
 
 static void switch2_bulk_out(struct urb *urb)
 {
 	struct switch2_usb *ns2_usb = urb->context;
-	int i;
+	unsigned int i;
 
 	guard(spinlock_irqsave)(&ns2_usb->bulk_out_lock);
 
+	for (i = 0; i < NS2_OUT_URBS; i++)
+		if (ns2_usb->bulk_out[i].urb == urb)
+			break;
+	if (WARN_ON_ONCE(i == NS2_OUT_URBS))
+		return;
+
+	trace_switch2_bulk_out(ns2_usb->cfg.parent->phys, i, urb->status);
+
 	switch (urb->status) {
 	case 0:
 		break;
 	case -ECONNRESET:
 	case -ENOENT:
 	case -ESHUTDOWN:
+		clear_bit(i, &ns2_usb->bulk_out_busy);
 		return;
 	default:
 		dev_dbg(&ns2_usb->udev->dev, "unknown urb status: %d\n", urb->status);
-		return;
-	}
-
-	for (i = 0; i < NS2_OUT_URBS; i++) {
-		if (ns2_usb->bulk_out[i].urb != urb)
-			continue;
-
-		ns2_usb->bulk_out[i].active = false;
 		break;
 	}
+
+	switch2_usb_drain_out(ns2_usb, i);
 }
 
+/*
+ * Commands go straight to a free bulk-out URB. When all of them are busy they
+ * wait in a bounded queue that completions drain in order; only a full queue
+ * is reported back as -EBUSY, so the caller can retry instead of the command
+ * silently vanishing.
+ */
 static int switch2_usb_send_cmd(enum switch2_cmd command, uint8_t subcommand,
 	const void *message, size_t size, struct switch2_cfg_intf *cfg)
 {
 	struct switch2_usb *ns2_usb = (struct switch2_usb *)cfg;
-	struct switch2_urb *urb = NULL;
-	int i;
-	int ret;
+	struct switch2_out_msg *msg;
+	uint8_t data[NS2_BULK_SIZE];
+	unsigned int i;
 
 	struct switch2_cmd_header header = {
 		command, NS2_DIR_OUT | NS2_FLAG_OK, NS2_TRANS_USB, subcommand, 0, size
 	};
 
-	if (WARN_ON(size > 56))
+	if (WARN_ON(size > NS2_BULK_SIZE - sizeof(header)))
 		return -EINVAL;
 
-	for (i = 0; i < NS2_OUT_URBS; i++) {
-		if (ns2_usb->bulk_out[i].active)
-			continue;
-
-		urb = &ns2_usb->bulk_out[i];
-		urb->active = true;
-		break;
-	}
-	if (!urb) {
-		dev_warn(&ns2_usb->udev->dev, "output queue full, dropping message\n");
-		return -ENOBUFS;
-	}
-
-	memcpy(urb->data, &header, sizeof(header));
+	memcpy(data, &header, sizeof(header));
 	if (message && size)
-		memcpy(&urb->data[8], message, size);
-	urb->urb->transfer_buffer_length = size + sizeof(header);
+		memcpy(&data[sizeof(header)], message, size);
 
-	print_hex_dump_debug("sending cmd: ", DUMP_PREFIX_OFFSET, 16, 1, urb->data,
-		size + sizeof(header), false);
+	guard(spinlock_irqsave)(&ns2_usb->bulk_out_lock);
 
-	usb_anchor_urb(urb->urb, &ns2_usb->bulk_out_anchor);
-	ret = usb_submit_urb(urb->urb, GFP_ATOMIC);
-	if (ret) {
-		dev_warn(&ns2_usb->udev->dev, "failed to submit urb: %i", ret);
-		urb->active = false;
-		usb_unanchor_urb(urb->urb);
-		return ret;
+	if (READ_ONCE(ns2_usb->disconnected))
+		return -ENODEV;
+
+	/* Anything already queued goes first */
+	if (!ns2_usb->out_queue_count) {
+		for (i = find_first_zero_bit(&ns2_usb->bulk_out_busy, NS2_OUT_URBS);
+		     i < NS2_OUT_URBS;
+		     i = find_next_zero_bit(&ns2_usb->bulk_out_busy, NS2_OUT_URBS, i + 1)) {
+			if (test_and_set_bit(i, &ns2_usb->bulk_out_busy))
+				continue;
+			trace_switch2_send_command(cfg->parent->phys, command, subcommand,
+				size, false);
+			return switch2_usb_submit_out(ns2_usb, i, data, size + sizeof(header));
+		}
 	}
 
+	if (ns2_usb->out_queue_count == NS2_OUT_QUEUE_LEN) {
+		dev_warn_ratelimited(&ns2_usb->udev->dev, "output queue full\n");
+		switch2_stat_inc(cfg->parent, out_queue_full);
+		return -EBUSY;
+	}
+
+	msg = &ns2_usb->out_queue[(ns2_usb->out_queue_head + ns2_usb->out_queue_count) %
+		NS2_OUT_QUEUE_LEN];
+	memcpy(msg->data, data, size + sizeof(header));
+	msg->length = size + sizeof(header);
+	ns2_usb->out_queue_count++;
+	trace_switch2_send_command(cfg->parent->phys, command, subcommand, size, true);
 	return 0;
 }
 
 static void switch2_usb_message_in_work(struct work_struct *work)
 {
 	struct switch2_usb *ns2_usb = container_of(work, struct switch2_usb, message_in_work);
-	struct switch2_urb *urb;
+	unsigned int head = ns2_usb->message_in_head;
+	unsigned int i;
 	int err;
-	unsigned long flags;
 
-	spin_lock_irqsave(&ns2_usb->bulk_in_lock, flags);
-	urb = &ns2_usb->bulk_in[ns2_usb->message_in];
-	spin_unlock_irqrestore(&ns2_usb->bulk_in_lock, flags);
+	/*
+	 * Drain everything that completed, handing each buffer over in place
+	 * and putting its URB back on the wire as soon as we're done with it.
+	 */
+	while (head != smp_load_acquire(&ns2_usb->message_in_tail)) {
+		const uint8_t *data;
+		size_t length, len;
+		struct urb *urb;
+
+		i = ns2_usb->message_in[head & ns2_usb->message_in_mask];
+		urb = ns2_usb->bulk_in[i].urb;
+		trace_switch2_message_in(ns2_usb->cfg.parent->phys, ns2_usb->bulk_in[i].seq,
+			ns2_usb->bulk_in[i].data[0], ns2_usb->bulk_in[i].data[3]);
+		data = urb->transfer_buffer;
+		for (length = urb->actual_length; length; data += len, length -= len) {
+			len = switch2_usb_message_len(data, length);
+			err = switch2_receive_command(ns2_usb->cfg.parent, data, len);
+			if (err)
+				dev_dbg(&ns2_usb->udev->dev, "receive command failed: %d\n",
+					err);
+		}
 
-	err = switch2_receive_command(ns2_usb->cfg.parent, urb->urb->transfer_buffer,
-		urb->urb->actual_length);
-	if (err)
-		dev_dbg(&ns2_usb->udev->dev, "receive command failed: %d\n", err);
+		head++;
+		WRITE_ONCE(ns2_usb->message_in_head, head);
+		if (!READ_ONCE(ns2_usb->disconnected))
+			switch2_usb_submit_in(ns2_usb, i, GFP_KERNEL);
+	}
+
+	/* Retry anything that failed to submit or completed with an error */
+	for_each_set_bit(i, &ns2_usb->bulk_in_idle, ns2_usb->bulk_in_count) {
+		if (READ_ONCE(ns2_usb->disconnected))
+			break;
+		if (test_and_clear_bit(i, &ns2_usb->bulk_in_idle))
+			switch2_usb_submit_in(ns2_usb, i, GFP_KERNEL);
+	}
+}
+
+static void switch2_usb_free_in(struct switch2_usb *ns2_usb)
+{
+	int i;
+
+	for (i = 0; i < ns2_usb->bulk_in_count; i++) {
+		if (!ns2_usb->bulk_in[i].urb)
+			continue;
+		usb_free_coherent(ns2_usb->udev, NS2_BULK_IN_SIZE, ns2_usb->bulk_in[i].data,
+			ns2_usb->bulk_in[i].urb->transfer_dma);
+		usb_free_urb(ns2_usb->bulk_in[i].urb);
+	}
+}
+
+/*
+ * Stop every bulk-in URB and wait for the worker to finish. Until
+ * switch2_usb_restart_in() nothing is received and no command can be sent.
+ */
+static void switch2_usb_stop_in(struct switch2_usb *ns2_usb)
+{
+	int i;
+
+	WRITE_ONCE(ns2_usb->disconnected, true);
+	for (i = 0; i < ns2_usb->bulk_in_count; i++)
+		usb_poison_urb(ns2_usb->bulk_in[i].urb);
+	cancel_work_sync(&ns2_usb->message_in_work);
+}
 
-	spin_lock_irqsave(&ns2_usb->bulk_in_lock, flags);
-	urb->active = false;
-	spin_unlock_irqrestore(&ns2_usb->bulk_in_lock, flags);
+/*
+ * Every URB is idle after switch2_usb_stop_in(), and whatever the ring still
+ * holds answers requests that were cancelled, so start over from empty.
+ */
+static int switch2_usb_restart_in(struct switch2_usb *ns2_usb)
+{
+	unsigned int listening = 0;
+	int i;
+
+	ns2_usb->message_in_head = ns2_usb->message_in_tail;
+	ns2_usb->bulk_in_idle = 0;
+	for (i = 0; i < ns2_usb->bulk_in_count; i++)
+		usb_unpoison_urb(ns2_usb->bulk_in[i].urb);
+	WRITE_ONCE(ns2_usb->disconnected, false);
+
+	for (i = 0; i < ns2_usb->bulk_in_count; i++)
+		if (!switch2_usb_submit_in(ns2_usb, i, GFP_NOIO))
+			listening++;
+	if (!listening)
+		return -EIO;
+	if (ns2_usb->bulk_in_idle)
+		switch2_queue_work(&ns2_usb->message_in_work);
+	return 0;
+}
+
+/* Must be called after switch2_usb_stop_in(), so nothing new is queued */
+static void switch2_usb_stop_out(struct switch2_usb *ns2_usb)
+{
+	scoped_guard(spinlock_irqsave, &ns2_usb->bulk_out_lock)
+		ns2_usb->out_queue_count = 0;
+	usb_kill_anchored_urbs(&ns2_usb->bulk_out_anchor);
 }
 
 static int switch2_usb_probe(struct usb_interface *intf, const struct usb_device_id *id)
@@ -194,7 +414,8 @@ static int switch2_usb_probe(struct usb_interface *intf, const struct usb_device
 	struct switch2_usb *ns2_usb;
 	struct usb_device *udev;
 	struct usb_endpoint_descriptor *bulk_in, *bulk_out;
-	char phys[64];
+	unsigned int listening = 0;
+	char phys[NS2_PHYS_MAX];
 	int ret;
 	int i;
 
@@ -213,14 +434,28 @@ static int switch2_usb_probe(struct usb_interface *intf, const struct usb_device
 		return -ENOMEM;
 
 	ns2_usb->udev = udev;
-	for (i = 0; i < NS2_IN_URBS; i++) {
+	ns2_usb->bulk_in_count = clamp(in_urbs, 2u, NS2_IN_URBS_MAX);
+	ns2_usb->bulk_in = devm_kcalloc(&intf->dev, ns2_usb->bulk_in_count,
+		sizeof(*ns2_usb->bulk_in), GFP_KERNEL);
+	ns2_usb->message_in_mask = roundup_pow_of_two(ns2_usb->bulk_in_count) - 1;
+	ns2_usb->message_in = devm_kcalloc(&intf->dev, ns2_usb->message_in_mask + 1,
+		sizeof(*ns2_usb->message_in), GFP_KERNEL);
+	if (!ns2_usb->bulk_in || !ns2_usb->message_in)
+		return -ENOMEM;
+
+	init_usb_anchor(&ns2_usb->bulk_out_anchor);
+	spin_lock_init(&ns2_usb->bulk_out_lock);
+	init_usb_anchor(&ns2_usb->bulk_in_anchor);
+	INIT_WORK(&ns2_usb->message_in_work, switch2_usb_message_in_work);
+
+	for (i = 0; i < ns2_usb->bulk_in_count; i++) {
 		ns2_usb->bulk_in[i].urb = usb_alloc_urb(0, GFP_KERNEL);
 		if (!ns2_usb->bulk_in[i].urb) {
 			ret = -ENOMEM;
 			goto err_free_in;
 		}
 
-		ns2_usb->bulk_in[i].data = usb_alloc_coherent(udev, NS2_BULK_SIZE, GFP_KERNEL,
+		ns2_usb->bulk_in[i].data = usb_alloc_coherent(udev, NS2_BULK_IN_SIZE, GFP_KERNEL,
 			&ns2_usb->bulk_in[i].urb->transfer_dma);
 		if (!ns2_usb->bulk_in[i].data) {
 			ret = -ENOMEM;
@@ -229,7 +464,7 @@ static int switch2_usb_probe(struct usb_interface *intf, const struct usb_device
 
 		usb_fill_bulk_urb(ns2_usb->bulk_in[i].urb, udev,
 			usb_rcvbulkpipe(udev, bulk_in->bEndpointAddress),
-			ns2_usb->bulk_in[i].data, NS2_BULK_SIZE, switch2_bulk_in, ns2_usb);
+			ns2_usb->bulk_in[i].data, NS2_BULK_IN_SIZE, switch2_bulk_in, ns2_usb);
 		ns2_usb->bulk_in[i].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	}
 
@@ -253,54 +488,48 @@ static int switch2_usb_probe(struct usb_interface *intf, const struct usb_device
 		ns2_usb->bulk_out[i].urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 	}
 
-	ns2_usb->bulk_in[0].active = true;
-	ret = usb_submit_urb(ns2_usb->bulk_in[0].urb, GFP_ATOMIC);
-	if (ret < 0)
-		goto err_free_out;
-
 	ns2 = switch2_get_controller(phys);
 	if (IS_ERR(ns2)) {
 		ret = PTR_ERR(ns2);
-		goto err_kill_urb;
+		goto err_free_out;
 	}
 
 	ns2_usb->cfg.parent = ns2;
+	ns2_usb->cfg.queue_depth = NS2_OUT_URBS;
+	ns2_usb->cfg.max_reply = NS2_BULK_IN_SIZE;
 	ns2_usb->cfg.send_command = switch2_usb_send_cmd;
 
-	init_usb_anchor(&ns2_usb->bulk_out_anchor);
-	spin_lock_init(&ns2_usb->bulk_out_lock);
-	init_usb_anchor(&ns2_usb->bulk_in_anchor);
-	spin_lock_init(&ns2_usb->bulk_in_lock);
-	INIT_WORK(&ns2_usb->message_in_work, switch2_usb_message_in_work);
-
 	usb_set_intfdata(intf, ns2_usb);
 
-	mutex_lock(&ns2->lock);
-	ns2->cfg = (struct switch2_cfg_intf *) ns2_usb;
-
-	if (ns2->hdev) {
-		ret = switch2_init_controller(ns2);
-		mutex_unlock(&ns2->lock);
-		return ret;
+	/* Listen before anything is sent, so no response can be missed */
+	for (i = 0; i < ns2_usb->bulk_in_count; i++)
+		if (!switch2_usb_submit_in(ns2_usb, i, GFP_KERNEL))
+			listening++;
+	if (!listening) {
+		ret = -EIO;
+		goto err_put;
 	}
 
+	mutex_lock(&ns2->lock);
+	ns2->cfg = (struct switch2_cfg_intf *) ns2_usb;
 	mutex_unlock(&ns2->lock);
+
+	switch2_schedule_init(ns2);
 	return 0;
 
-err_kill_urb:
-	usb_kill_urb(ns2_usb->bulk_in[0].urb);
+err_put:
+	switch2_usb_stop_in(ns2_usb);
+	switch2_controller_put(ns2);
 err_free_out:
 	for (i = 0; i < NS2_OUT_URBS; i++) {
+		if (!ns2_usb->bulk_out[i].urb)
+			continue;
 		usb_free_coherent(ns2_usb->udev, NS2_BULK_SIZE, ns2_usb->bulk_out[i].data,
 			ns2_usb->bulk_out[i].urb->transfer_dma);
 		usb_free_urb(ns2_usb->bulk_out[i].urb);
 	}
 err_free_in:
-	for (i = 0; i < NS2_IN_URBS; i++) {
-		usb_free_coherent(ns2_usb->udev, NS2_BULK_SIZE, ns2_usb->bulk_in[i].data,
-			ns2_usb->bulk_in[i].urb->transfer_dma);
-		usb_free_urb(ns2_usb->bulk_in[i].urb);
-	}
+	switch2_usb_free_in(ns2_usb);
 	devm_kfree(&intf->dev, ns2_usb);
 
 	return ret;
@@ -312,26 +541,49 @@ static void switch2_usb_disconnect(struct usb_interface *intf)
 	struct switch2_controller *ns2 = ns2_usb->cfg.parent;
 	int i;
 
-	usb_kill_anchored_urbs(&ns2_usb->bulk_out_anchor);
+	switch2_usb_stop_in(ns2_usb);
+	switch2_usb_free_in(ns2_usb);
+	switch2_usb_stop_out(ns2_usb);
 	for (i = 0; i < NS2_OUT_URBS; i++) {
 		usb_free_coherent(ns2_usb->udev, NS2_BULK_SIZE, ns2_usb->bulk_out[i].data,
 			ns2_usb->bulk_out[i].urb->transfer_dma);
 		usb_free_urb(ns2_usb->bulk_out[i].urb);
 	}
 
-	usb_kill_anchored_urbs(&ns2_usb->bulk_in_anchor);
-	for (i = 0; i < NS2_IN_URBS; i++) {
-		usb_free_coherent(ns2_usb->udev, NS2_BULK_SIZE, ns2_usb->bulk_in[i].data,
-			ns2_usb->bulk_in[i].urb->transfer_dma);
-		usb_free_urb(ns2_usb->bulk_in[i].urb);
-	}
-
 	mutex_lock(&ns2->lock);
 	ns2->cfg = NULL;
 	mutex_unlock(&ns2->lock);
 	switch2_controller_put(ns2);
 }
 
+/*
+ * The URBs stay allocated and the controller stays bound over a suspend; only
+ * the traffic stops. Nothing is left in flight for the HCD to give back.
+ */
+static int switch2_usb_suspend(struct usb_interface *intf, pm_message_t message)
+{
+	struct switch2_usb *ns2_usb = usb_get_intfdata(intf);
+
+	switch2_controller_suspend(ns2_usb->cfg.parent, NS2_PM_CFG);
+	switch2_usb_stop_in(ns2_usb);
+	switch2_usb_stop_out(ns2_usb);
+	return 0;
+}
+
+/* Failing here leaves the USB core to rebind the interface from scratch */
+static int switch2_usb_resume(struct usb_interface *intf)
+{
+	struct switch2_usb *ns2_usb = usb_get_intfdata(intf);
+	int ret;
+
+	ret = switch2_usb_restart_in(ns2_usb);
+	if (ret)
+		return ret;
+
+	switch2_controller_resume(ns2_usb->cfg.parent, NS2_PM_CFG);
+	return 0;
+}
+
 #define SWITCH2_CONTROLLER(vend, prod) \
 	USB_DEVICE_AND_INTERFACE_INFO(vend, prod, USB_CLASS_VENDOR_SPEC, 0, 0)
 
@@ -349,6 +601,12 @@ static struct usb_driver switch2_usb = {
 	.id_table	= switch2_usb_devices,
 	.probe		= switch2_usb_probe,
 	.disconnect	= switch2_usb_disconnect,
+	.suspend	= switch2_usb_suspend,
+	.resume		= switch2_usb_resume,
+	.reset_resume	= switch2_usb_resume,
+	.driver = {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
 module_usb_driver(switch2_usb);
 